@@ -0,0 +1,124 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Exercises the library. Several threads compile the same file at once, each
+ * in its own context and several times over, with a resolver supplying the
+ * included files. The output goes to stdout, after checking that every
+ * compile produced the same text.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "outline2c.h"
+
+#define THREADS 4
+#define ROUNDS 3
+
+typedef struct {
+  char const *filename;
+  char *text;             /* The last file the resolver read */
+  char *output;
+  size_t output_size;
+  int ok;
+} Job;
+
+static char *read_file(char const *filename, size_t *size)
+{
+  FILE *file = fopen(filename, "rb");
+  char *text;
+  long n;
+
+  if (!file) return 0;
+  fseek(file, 0, SEEK_END);
+  n = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  text = (char*)malloc(n + 1);
+  if (text && fread(text, 1, n, file) != (size_t)n) {
+    free(text);
+    text = 0;
+  }
+  fclose(file);
+  *size = n;
+  return text;
+}
+
+static int resolve(void *data, char const *filename, char const **text, size_t *size)
+{
+  Job *job = (Job*)data;
+  free(job->text);
+  job->text = read_file(filename, size);
+  *text = job->text;
+  return !!job->text;
+}
+
+static void *run(void *data)
+{
+  Job *job = (Job*)data;
+  Outline2cContext *context = outline2c_context_new();
+  char *text;
+  size_t size;
+  int i;
+
+  text = read_file(job->filename, &size);
+  job->ok = context && text;
+  for (i = 0; job->ok && i < ROUNDS; ++i) {
+    outline2c_free_output(job->output);
+    job->output = 0;
+    job->ok = outline2c_compile(context, job->filename, text, size,
+      resolve, job, &job->output, &job->output_size);
+    if (!job->ok)
+      fputs(outline2c_errors(context), stderr);
+  }
+  free(text);
+  free(job->text);
+  outline2c_context_free(context);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t threads[THREADS];
+  Job jobs[THREADS];
+  int i, rv = 0;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <input-file>\n", argv[0]);
+    return 1;
+  }
+
+  for (i = 0; i < THREADS; ++i) {
+    memset(&jobs[i], 0, sizeof(Job));
+    jobs[i].filename = argv[1];
+    pthread_create(&threads[i], 0, run, &jobs[i]);
+  }
+  for (i = 0; i < THREADS; ++i)
+    pthread_join(threads[i], 0);
+
+  for (i = 0; i < THREADS; ++i) {
+    if (!jobs[i].ok || jobs[i].output_size != jobs[0].output_size ||
+      memcmp(jobs[i].output, jobs[0].output, jobs[0].output_size)) {
+      fprintf(stderr, "error: Compile %d failed or did not match.\n", i);
+      rv = 1;
+    }
+  }
+  if (!rv)
+    fwrite(jobs[0].output, 1, jobs[0].output_size, stdout);
+  for (i = 0; i < THREADS; ++i)
+    outline2c_free_output(jobs[i].output);
+  return rv;
+}
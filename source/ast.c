@@ -85,11 +85,16 @@ typedef struct {
 typedef struct AstOutline AstOutline;
 
 /**
- * An individual word in an outline item.
+ * An individual word in an outline item. A value is only parsed once
+ * something looks it up.
  */
 typedef struct {
   String name;
   ListNode *value;
+  String text;    /* The value's source code, if any */
+  Scope *scope;   /* Where to parse the value */
+  Pool *pool;
+  int parsed;
 } AstOutlineTag;
 
 /**
@@ -101,11 +106,114 @@ struct AstOutlineItem {
   AstOutline *children;
 };
 
+typedef struct AstSubset AstSubset;
+
+/**
+ * The items in an outline which pass a filter, kept for reuse.
+ */
+struct AstSubset {
+  AstSubset *next;
+  String filter;   /* The filter in standard form, from filter_key */
+  ListNode *items; /* Real type is AstOutlineItem */
+};
+
+typedef struct AstOrder AstOrder;
+
+/**
+ * An outline's items in sorted order, kept for reuse.
+ */
+struct AstOrder {
+  AstOrder *next;
+  String tag;       /* Null when sorted by name */
+  ListNode **items;
+  size_t count;
+};
+
+/**
+ * One of the outlines making up a union.
+ */
+typedef struct {
+  Dynamic outline;
+  Dynamic filter;
+} AstUnionPart;
+
+/**
+ * The parts of a union, and what to do with their items once they are
+ * gathered.
+ */
+typedef struct {
+  ListNode *parts; /* Real type is AstUnionPart */
+  int distinct;    /* Drop items whose names appeared in earlier parts */
+  int sorted;      /* Sort the union's items once they are gathered */
+  String sort_tag; /* Null to sort by name */
+} AstUnion;
+
+/**
+ * A run of numbers, standing in for an outline with one item per number.
+ * Each item's name is the prefix followed by the number.
+ */
+typedef struct {
+  long first;
+  long end;        /* One past the last number */
+  String prefix;
+} AstRange;
+
+/**
+ * An outline whose items are gathered into groups by the value of a tag.
+ */
+typedef struct {
+  Dynamic outline;
+  String tag;
+} AstGroup;
+
+/**
+ * An outline pairing the items from two outlines whose keys match. A key is
+ * the value of a tag, or the item's name if there is no tag.
+ */
+typedef struct {
+  Dynamic left;
+  Dynamic right;
+  String left_tag;  /* Null to match by name */
+  String right_tag;
+} AstJoin;
+
+/**
+ * An outline's items rearranged into the slots of a minimal perfect hash
+ * table. A key is the value of a tag, or the item's name if there is no tag.
+ */
+typedef struct {
+  char const *start;  /* For error messages */
+  Dynamic outline;
+  String tag;         /* Null to hash the names */
+} AstPerfectHash;
+
 /**
- * An outline.
+ * An outline whose items live somewhere else, such as a precompiled library.
+ */
+typedef struct {
+  int (*load)(AstOutline *outline, void *data); /* Builds the items */
+  void *data;
+} AstOutlineLoad;
+
+/**
+ * An outline. The body is only parsed once something needs the items. An
+ * outline without a body has a source instead, whose type says where the
+ * items come from: a union gathers them from its parts once something needs
+ * them all at once, a range makes them up as they are needed, and groups,
+ * joins and perfect hashes sort out other outlines' items once something
+ * needs them. An outline from a precompiled library builds its items from
+ * the mapped file the same way.
  */
 struct AstOutline {
   ListNode *items; /* Real type is AstOutlineItem */
+  Dynamic source;  /* Where the items come from, if there is no body */
+  Source code;     /* The body, until it is parsed */
+  Scope *scope;
+  Pool *pool;
+  int parsed;
+  AstSubset *subsets;
+  HashTable *index; /* Items by name, once something looks one up */
+  AstOrder *orders;
 };
 
 typedef struct {
@@ -130,10 +238,22 @@ typedef struct {
   Dynamic filter;
   int reverse;
   int list;
+  int shard;
+  int sorted;
+  String sort_tag;  /* Null to sort by name */
   Scope *scope;
   Source code;
 } AstFor;
 
+/**
+ * An output statement, which sends a block of code to a file of its own.
+ */
+typedef struct {
+  char const *start;  /* For error messages */
+  String filename;
+  ListNode *code;
+} AstOutput;
+
 /**
  * A run of text in the host language.
  */
@@ -178,11 +298,138 @@ AstLookup *ast_lookup_new(Pool *p, AstOutlineItem *item, String name)
   return self;
 }
 
-AstOutlineTag *ast_outline_tag_new(Pool *p, String name, ListNode *value)
+AstOutlineTag *ast_outline_tag_new(Pool *p, String name, String text, Scope *scope)
 {
   AstOutlineTag *self = pool_new(p, AstOutlineTag);
   self->name = string_copy(p, name);
-  self->value = value; /* value may be NULL */
+  self->value = 0;
+  self->text = text; /* text.p is 0 if there is no value */
+  self->scope = scope;
+  self->pool = p;
+  self->parsed = !text.p;
+  return self;
+}
+
+/**
+ * Makes an outline whose items are already known.
+ */
+AstOutline *ast_outline_new(Pool *p, ListNode *items)
+{
+  AstOutline *self = pool_new(p, AstOutline);
+  self->items = items;
+  self->source = dynamic_none();
+  self->scope = 0;
+  self->pool = p;
+  self->parsed = 1;
+  self->subsets = 0;
+  self->index = 0;
+  self->orders = 0;
+  return self;
+}
+
+/**
+ * Makes a union, whose items come from its parts once they are needed.
+ */
+AstOutline *ast_union_new(Pool *p, ListNode *parts, int distinct,
+  int sorted, String sort_tag)
+{
+  AstOutline *self = ast_outline_new(p, 0);
+  AstUnion *u = pool_new(p, AstUnion);
+  u->parts = parts;
+  u->distinct = distinct;
+  u->sorted = sorted;
+  u->sort_tag = sort_tag.p ? string_copy(p, sort_tag) : sort_tag;
+  self->source = dynamic(type_union, u);
+  self->parsed = 0;
+  return self;
+}
+
+/**
+ * Makes a range, whose items come into being as they are needed.
+ */
+AstOutline *ast_range_new(Pool *p, long first, long end, String prefix)
+{
+  AstOutline *self = ast_outline_new(p, 0);
+  AstRange *range = pool_new(p, AstRange);
+  range->first = first;
+  range->end = end;
+  range->prefix = prefix.p ? string_copy(p, prefix) : prefix;
+  self->source = dynamic(type_range, range);
+  self->parsed = 0;
+  return self;
+}
+
+/**
+ * Makes a group, which gathers the items from another outline once they
+ * are needed.
+ */
+AstOutline *ast_group_new(Pool *p, Dynamic outline, String tag)
+{
+  AstOutline *self = ast_outline_new(p, 0);
+  AstGroup *group = pool_new(p, AstGroup);
+  group->outline = outline;
+  group->tag = string_copy(p, tag);
+  self->source = dynamic(type_group, group);
+  self->parsed = 0;
+  return self;
+}
+
+/**
+ * Makes a join, which pairs up the items from two outlines once they are
+ * needed.
+ */
+AstOutline *ast_join_new(Pool *p, Dynamic left, String left_tag,
+  Dynamic right, String right_tag)
+{
+  AstOutline *self = ast_outline_new(p, 0);
+  AstJoin *join = pool_new(p, AstJoin);
+  join->left = left;
+  join->right = right;
+  join->left_tag = left_tag.p ? string_copy(p, left_tag) : left_tag;
+  join->right_tag = right_tag.p ? string_copy(p, right_tag) : right_tag;
+  self->source = dynamic(type_join, join);
+  self->parsed = 0;
+  return self;
+}
+
+/**
+ * Makes a perfect hash, which works out the slots for another outline's items
+ * once they are needed.
+ */
+AstOutline *ast_perfect_hash_new(Pool *p, char const *start, Dynamic outline, String tag)
+{
+  AstOutline *self = ast_outline_new(p, 0);
+  AstPerfectHash *perfect = pool_new(p, AstPerfectHash);
+  perfect->start = start;
+  perfect->outline = outline;
+  perfect->tag = tag.p ? string_copy(p, tag) : tag;
+  self->source = dynamic(type_perfect_hash, perfect);
+  self->parsed = 0;
+  return self;
+}
+
+/**
+ * Makes up the item for one of the numbers in a range.
+ */
+AstOutlineItem *ast_range_item(Pool *p, AstRange *range, long n)
+{
+  AstOutlineItem *self = pool_new(p, AstOutlineItem);
+  char number[32];
+
+  sprintf(number, "%ld", n);
+  self->tags = 0;
+  self->name = range->prefix.p ?
+    string_cat(p, range->prefix, string_from_c(number)) :
+    string_copy(p, string_from_c(number));
+  self->children = 0;
+  return self;
+}
+
+AstUnionPart *ast_union_part_new(Pool *p, Dynamic outline, Dynamic filter)
+{
+  AstUnionPart *self = pool_new(p, AstUnionPart);
+  self->outline = outline;
+  self->filter = filter;
   return self;
 }
 
@@ -193,6 +440,21 @@ AstCodeText *ast_code_text_new(Pool *p, String code)
   return self;
 }
 
+/**
+ * Makes a tag whose value is text the compiler worked out, such as a
+ * number, rather than code from the input.
+ */
+AstOutlineTag *ast_outline_tag_text(Pool *p, String name, String text)
+{
+  AstOutlineTag *self = ast_outline_tag_new(p, name, string_copy(p, text), 0);
+  ListBuilder value = list_builder_init(p);
+
+  list_builder_add(&value, dynamic(type_code_text, ast_code_text_new(p, text)));
+  self->value = value.first;
+  self->parsed = 1;
+  return self;
+}
+
 /**
  * The ability to appear in debug dumps
  */
@@ -215,7 +477,11 @@ int can_test_filter(Dynamic value)
 /**
  * The ability to behave as an outline
  */
-ListNode *get_items(Dynamic node);
+int get_items(Dynamic node, ListNode **items);
+int get_filtered_items(Pool *pool, Dynamic node, Dynamic filter, ListNode **items);
+int get_item_by_name(Dynamic node, String name, AstOutlineItem **item);
+int get_sorted_items(Dynamic node, String tag, ListNode ***items, size_t *count);
+ListNode **sort_items(Pool *pool, ListNode *items, String tag, size_t *count);
 int can_get_items(Dynamic value)
 {
   return
@@ -226,7 +492,7 @@ int can_get_items(Dynamic value)
 /**
  * The ability to generate output text
  */
-int generate(Pool *pool, FILE *out, Dynamic node);
+int generate(Pool *pool, Buffer *out, Dynamic node);
 int can_generate(Dynamic value)
 {
   return
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * A block of memory for collecting generated text.
+ *
+ * If the buffer has a flush routine, it hands its contents off to that
+ * routine whenever it fills up. The flush routine must leave the buffer empty,
+ * but it may swap in a different block of memory while doing so. Without a
+ * flush routine, the buffer simply grows to hold everything written to it.
+ */
+typedef struct Buffer Buffer;
+struct Buffer {
+  char *p;      /* The start of the memory block */
+  char *end;    /* One-past the last byte written */
+  char *cap;    /* One-past the end of the memory block */
+  int (*flush)(void *data, Buffer *b);
+  void *data;
+};
+
+/**
+ * Initializes a growable buffer with the given starting capacity.
+ */
+Buffer buffer_init(size_t size)
+{
+  Buffer self;
+  self.p = (char*)malloc(size);
+  CHECK_MEMORY(self.p);
+  self.end = self.p;
+  self.cap = self.p + size;
+  self.flush = 0;
+  self.data = 0;
+  return self;
+}
+
+void buffer_free(Buffer *b)
+{
+  free(b->p);
+  b->p = b->end = b->cap = 0;
+}
+
+#define buffer_size(b) ((size_t)((b)->end - (b)->p))
+
+/**
+ * Makes room for at least `size` more bytes, either by flushing or by
+ * growing the memory block.
+ */
+int buffer_reserve(Buffer *b, size_t size)
+{
+  size_t used, new_size;
+  char *p;
+
+  if (size <= (size_t)(b->cap - b->end))
+    return 1;
+
+  if (b->flush) {
+    CHECK(b->flush(b->data, b));
+    if (size <= (size_t)(b->cap - b->end))
+      return 1;
+  }
+
+  used = buffer_size(b);
+  new_size = b->cap - b->p;
+  while (new_size - used < size)
+    new_size *= 2;
+  p = (char*)realloc(b->p, new_size);
+  CHECK_MEMORY(p);
+  b->p = p;
+  b->end = p + used;
+  b->cap = p + new_size;
+  return 1;
+}
+
+/**
+ * Appends bytes to the buffer. Returns 0 for failure.
+ */
+int buffer_write(Buffer *b, char const *p, char const *end)
+{
+  /* Pass large writes through in buffer-sized pieces: */
+  while (b->flush && b->cap - b->end < end - p) {
+    size_t room = b->cap - b->end;
+    memcpy(b->end, p, room);
+    b->end += room;
+    p += room;
+    CHECK(b->flush(b->data, b));
+  }
+
+  CHECK(buffer_reserve(b, end - p));
+  memcpy(b->end, p, end - p);
+  b->end += end - p;
+  return 1;
+}
+
+int buffer_putc_slow(Buffer *b, char c)
+{
+  CHECK(buffer_reserve(b, 1));
+  *b->end++ = c;
+  return 1;
+}
+
+/* Appends a single character to the buffer. Returns 0 for failure. */
+#define buffer_putc(b, c) \
+  ((b)->end < (b)->cap ? (*(b)->end++ = (c), 1) : buffer_putc_slow(b, c))
+
+/**
+ * Passes any remaining contents to the flush routine, if there is one.
+ */
+int buffer_flush(Buffer *b)
+{
+  if (b->flush && b->end != b->p)
+    CHECK(b->flush(b->data, b));
+  return 1;
+}
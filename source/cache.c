@@ -0,0 +1,335 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * An on-disk cache of generated output, along the lines of ccache. Each
+ * output is filed under a hash of everything that went into it: the compiler
+ * build, the input file name, and the contents of the input file and every
+ * file it might include. A build which finds its hash in the cache copies
+ * the stored output into place, without parsing or generating anything.
+ *
+ * Entries live in 256 subdirectories, named after the first two hex digits
+ * of their hash. Each hit touches its entry, so the modification times give
+ * the least-recently-used order for eviction. The hit and size counters live
+ * in a small text file, with a lock file to keep concurrent builds in step.
+ */
+
+/* Identifies the compiler build, so a new compiler never sees old outputs: */
+#define CACHE_BUILD "outline2c " __DATE__ " " __TIME__
+
+#define CACHE_HASH_INIT UINT64_C(0xcbf29ce484222325)
+
+typedef struct {
+  String dir;
+  uint64_t limit;         /* Maximum total size, in bytes */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t files;
+  uint64_t size;
+  int lock;               /* Lock file descriptor */
+} Cache;
+
+/**
+ * Adds a block of bytes to a 64-bit FNV-1a hash.
+ */
+uint64_t cache_hash(uint64_t hash, char const *p, char const *end)
+{
+  for (; p < end; ++p) {
+    hash ^= (unsigned char)*p;
+    hash *= UINT64_C(0x100000001b3);
+  }
+  return hash;
+}
+
+/**
+ * Hashes a run's source files in the order they were loaded,
+ * skipping repeats and the `skip` file, if any. Each file's name and size
+ * go in ahead of its text, so the boundaries between files are part of the
+ * hash. The caller holds the source lock.
+ */
+uint64_t cache_hash_sources(uint64_t hash, Source *self, Source *skip, int run)
+{
+  Source *other;
+  char size[32];
+
+  if (!self) return hash;
+  hash = cache_hash_sources(hash, self->next, skip, run);
+
+  if (self->run != run || self == skip) return hash;
+  for (other = self->next; other; other = other->next)
+    if (other->run == run && string_equal(other->filename, self->filename))
+      return hash;
+  sprintf(size, "%" PRIu64, (uint64_t)string_size(self->data));
+  hash = cache_hash(hash, self->filename.p, self->filename.end + 1);
+  hash = cache_hash(hash, size, size + strlen(size) + 1);
+  return cache_hash(hash, self->data.p, self->data.end);
+}
+
+/**
+ * Computes the cache key for the currently-loaded source files. None of the
+ * command-line options change the generated text, apart from the choice of
+ * input file, so the input's name goes into the hash along with the build.
+ */
+uint64_t cache_key(String name_in)
+{
+  Context *context = context_get();
+  uint64_t hash = CACHE_HASH_INIT;
+  char const build[] = CACHE_BUILD;
+
+  hash = cache_hash(hash, build, build + sizeof(build));
+  hash = cache_hash(hash, name_in.p, name_in.end);
+  mutex_lock(&context->source_lock);
+  hash = cache_hash_sources(hash, context->source_list, 0, context->source_run);
+  mutex_unlock(&context->source_lock);
+  return hash;
+}
+
+/**
+ * Finds the file name for a cache entry. The subdirectory name goes in
+ * `subdir`, if that is wanted.
+ */
+static String cache_entry(Pool *pool, Cache *self, uint64_t key, String *subdir)
+{
+  char name[24];
+  sprintf(name, "/%02x/%06lx%08lx", (unsigned)(key >> 56),
+    (unsigned long)(key >> 32) & 0xffffff, (unsigned long)key & 0xffffffff);
+  if (subdir)
+    *subdir = string_cat(pool, self->dir, string(name, name + 3));
+  return string_cat(pool, self->dir, string_from_c(name));
+}
+
+#if defined(WIN32)
+int cache_init(Pool *pool, Cache *self, String dir, uint64_t limit)
+{
+  fprintf(stderr, "error: The output cache is not supported on this platform.\n");
+  return 0;
+}
+
+void cache_free(Cache *self) { }
+int cache_fetch(Pool *pool, Cache *self, uint64_t key, String filename) { return 0; }
+int cache_store(Pool *pool, Cache *self, uint64_t key, char const *p, char const *end) { return 0; }
+#else
+
+/**
+ * Waits until no other compiler is using the cache counters.
+ */
+static int cache_lock(Cache *self)
+{
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  while (fcntl(self->lock, F_SETLKW, &lock))
+    if (errno != EINTR) return 0;
+  return 1;
+}
+
+static void cache_unlock(Cache *self)
+{
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_UNLCK;
+  lock.l_whence = SEEK_SET;
+  fcntl(self->lock, F_SETLK, &lock);
+}
+
+/**
+ * Reads the counters. A missing or damaged file just means starting over.
+ */
+static void cache_stats_read(Pool *pool, Cache *self)
+{
+  String name = string_cat(pool, self->dir, string_from_k("/stats"));
+  FILE *file = fopen(name.p, "r");
+
+  if (!file || 4 != fscanf(file, "hits %" SCNu64 " misses %" SCNu64
+    " files %" SCNu64 " size %" SCNu64, &self->hits, &self->misses,
+    &self->files, &self->size))
+    self->hits = self->misses = self->files = self->size = 0;
+  if (file) fclose(file);
+}
+
+static void cache_stats_write(Pool *pool, Cache *self)
+{
+  String name = string_cat(pool, self->dir, string_from_k("/stats"));
+  char text[128];
+
+  sprintf(text, "hits %" PRIu64 "\nmisses %" PRIu64 "\nfiles %" PRIu64
+    "\nsize %" PRIu64 "\n", self->hits, self->misses, self->files, self->size);
+  file_write(pool, name, text, text + strlen(text));
+}
+
+/**
+ * Opens the cache, creating the directory if needed.
+ */
+int cache_init(Pool *pool, Cache *self, String dir, uint64_t limit)
+{
+  String name;
+
+  self->dir = string_copy(pool, dir);
+  self->limit = limit;
+  mkdir(self->dir.p, 0777);
+
+  name = string_cat(pool, self->dir, string_from_k("/lock"));
+  self->lock = open(name.p, O_RDWR | O_CREAT, 0666);
+  if (self->lock < 0) {
+    fprintf(stderr, "error: Could not open the cache directory \"%s\"\n", self->dir.p);
+    return 0;
+  }
+  if (!cache_lock(self)) return 0;
+  cache_stats_read(pool, self);
+  cache_unlock(self);
+  return 1;
+}
+
+void cache_free(Cache *self)
+{
+  close(self->lock);
+}
+
+/**
+ * A cache entry, for sorting by age.
+ */
+typedef struct {
+  String name;
+  time_t mtime;
+  uint64_t size;
+} CacheFile;
+
+static int cache_file_compare(void const *a, void const *b)
+{
+  time_t ta = ((CacheFile const*)a)->mtime;
+  time_t tb = ((CacheFile const*)b)->mtime;
+  return ta < tb ? -1 : tb < ta;
+}
+
+/**
+ * Deletes the least-recently-used entries until the cache is back under
+ * nine tenths of its limit, which leaves some room before the next sweep.
+ * This also corrects the counters, which can drift when several compilers
+ * store the same entry at once. The caller holds the lock.
+ */
+static void cache_evict(Pool *pool, Cache *self)
+{
+  CacheFile *files = 0;
+  size_t count = 0, cap = 0, i;
+  unsigned d;
+
+  self->files = 0;
+  self->size = 0;
+  for (d = 0; d < 256; ++d) {
+    char sub[4];
+    String subdir;
+    DIR *dir;
+    struct dirent *entry;
+
+    sprintf(sub, "/%02x", d);
+    subdir = string_cat(pool, self->dir, string_from_c(sub));
+    dir = opendir(subdir.p);
+    if (!dir) continue;
+    while ((entry = readdir(dir))) {
+      struct stat st;
+      String name;
+
+      /* Skip "." and "..", plus files still being written: */
+      if (strchr(entry->d_name, '.')) continue;
+      name = string_cat(pool, subdir, string_cat(pool, string_from_k("/"),
+        string_from_c(entry->d_name)));
+      if (stat(name.p, &st) || !S_ISREG(st.st_mode)) continue;
+
+      if (count == cap) {
+        CacheFile *old = files;
+        cap = cap ? 2*cap : 256;
+        files = (CacheFile*)pool_alloc(pool, cap*sizeof(CacheFile), alignof(CacheFile));
+        if (count) memcpy(files, old, count*sizeof(CacheFile));
+      }
+      files[count].name = name;
+      files[count].mtime = st.st_mtime;
+      files[count].size = st.st_size;
+      ++count;
+      self->files += 1;
+      self->size += st.st_size;
+    }
+    closedir(dir);
+  }
+
+  if (count) qsort(files, count, sizeof(CacheFile), cache_file_compare);
+  for (i = 0; i < count && self->limit / 10 * 9 < self->size; ++i) {
+    if (remove(files[i].name.p)) continue;
+    self->files -= 1;
+    self->size -= files[i].size;
+  }
+}
+
+/**
+ * Copies a cached output into place, if there is one. Returns 0 for a miss.
+ * The file name "-" means standard output.
+ */
+int cache_fetch(Pool *pool, Cache *self, uint64_t key, String filename)
+{
+  String entry = cache_entry(pool, self, key, 0);
+  String text;
+
+  if (!file_read(pool, entry.p, &text)) return 0;
+  if (!file_update(pool, filename, text.p, text.end)) return 0;
+
+  /* Mark the entry as recently used: */
+  utimensat(AT_FDCWD, entry.p, 0, 0);
+  if (cache_lock(self)) {
+    cache_stats_read(pool, self);
+    self->hits += 1;
+    cache_stats_write(pool, self);
+    cache_unlock(self);
+  }
+  return 1;
+}
+
+/**
+ * Adds a freshly-generated output to the cache.
+ */
+int cache_store(Pool *pool, Cache *self, uint64_t key, char const *p, char const *end)
+{
+  String subdir, entry = cache_entry(pool, self, key, &subdir);
+
+  mkdir(subdir.p, 0777);
+  if (!file_write(pool, entry, p, end)) return 0;
+
+  if (!cache_lock(self)) return 0;
+  cache_stats_read(pool, self);
+  self->misses += 1;
+  self->files += 1;
+  self->size += end - p;
+  if (self->limit < self->size)
+    cache_evict(pool, self);
+  cache_stats_write(pool, self);
+  cache_unlock(self);
+  return 1;
+}
+#endif
+
+/**
+ * Prints the cache counters, for the --cache-stats option.
+ */
+void cache_print_stats(Cache *self)
+{
+  uint64_t total = self->hits + self->misses;
+
+  printf("cache directory  %s\n", self->dir.p);
+  printf("hits             %" PRIu64 "\n", self->hits);
+  printf("misses           %" PRIu64 "\n", self->misses);
+  printf("hit rate         %.1f%%\n", total ? 100.0*self->hits/total : 0.0);
+  printf("files            %" PRIu64 "\n", self->files);
+  printf("size             %" PRIu64 " bytes\n", self->size);
+  printf("size limit       %" PRIu64 " bytes\n", self->limit);
+}
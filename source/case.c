@@ -14,10 +14,6 @@
  * limitations under the License.
  */
 
-/* Writes bytes to a file, and returns 0 for failure. */
-#define file_write(file, p, end) (fwrite(p, 1, end - p, file) == end - p)
-#define file_putc(file, c) (fputc(c, file) != EOF)
-
 /**
  * Removes the leading and trailing underscores from an identifier.
  */
@@ -91,63 +87,63 @@ String scan_symbol(String s, char const *p)
 }
 
 /**
- * Writes leading underscores to a file, if any.
+ * Writes leading underscores to the output, if any.
  * @param s the entire string, including leading and trailing underscores.
  * @param inner the inner portion of the string after underscores have been
  * stripped.
  * @return 0 for failure
  */
-int write_leading(FILE *out, String s, String inner)
+int write_leading(Buffer *out, String s, String inner)
 {
   if (s.p != inner.p)
-    return file_write(out, s.p, inner.p);
+    return buffer_write(out, s.p, inner.p);
   return 1;
 }
 
-int write_trailing(FILE *out, String s, String inner)
+int write_trailing(Buffer *out, String s, String inner)
 {
   if (inner.end != s.end)
-    return file_write(out, inner.end, s.end);
+    return buffer_write(out, inner.end, s.end);
   return 1;
 }
 
 /**
- * Writes a word to a file in lower case.
+ * Writes a word to the output in lower case.
  */
-int write_lower(FILE *out, String s)
+int write_lower(Buffer *out, String s)
 {
   char const *p;
   for (p = s.p; p != s.end; ++p) {
     char c = 'A' <= *p && *p <= 'Z' ? *p - 'A' + 'a' : *p;
-    CHECK(file_putc(out, c));
+    CHECK(buffer_putc(out, c));
   }
   return 1;
 }
 
 /**
- * Writes a word to a file in UPPER case.
+ * Writes a word to the output in UPPER case.
  */
-int write_upper(FILE *out, String s)
+int write_upper(Buffer *out, String s)
 {
   char const *p;
   for (p = s.p; p != s.end; ++p) {
     char c = 'a' <= *p && *p <= 'z' ? *p - 'a' + 'A' : *p;
-    CHECK(file_putc(out, c));
+    CHECK(buffer_putc(out, c));
   }
   return 1;
 }
 
 /**
- * Writes a word to a file in Capitalized case.
+ * Writes a word to the output in Capitalized case.
  */
-int write_cap(FILE *out, String s)
+int write_cap(Buffer *out, String s)
 {
   char const *p;
   for (p = s.p; p != s.end; ++p) {
     char c = (p == s.p) ?
       ('a' <= *p && *p <= 'z' ? *p - 'a' + 'A' : *p) :
       ('A' <= *p && *p <= 'Z' ? *p - 'A' + 'a' : *p) ;
-    CHECK(file_putc(out, c));
+    CHECK(buffer_putc(out, c));
   }
   return 1;
 }
@@ -155,7 +151,7 @@ int write_cap(FILE *out, String s)
 /**
  * Writes a string to the output file, converting it to lower_case
  */
-int generate_lower(FILE *out, String s)
+int generate_lower(Buffer *out, String s)
 {
   String inner = strip_symbol(s);
   String word = scan_symbol(inner, inner.p);
@@ -165,7 +161,7 @@ int generate_lower(FILE *out, String s)
     write_lower(out, word);
     word = scan_symbol(inner, word.end);
     if (string_size(word))
-      CHECK(file_putc(out, '_'));
+      CHECK(buffer_putc(out, '_'));
   }
   write_trailing(out, s, inner);
 
@@ -175,7 +171,7 @@ int generate_lower(FILE *out, String s)
 /**
  * Writes a string to the output file, converting it to UPPER_CASE
  */
-int generate_upper(FILE *out, String s)
+int generate_upper(Buffer *out, String s)
 {
   String inner = strip_symbol(s);
   String word = scan_symbol(inner, inner.p);
@@ -185,7 +181,7 @@ int generate_upper(FILE *out, String s)
     write_upper(out, word);
     word = scan_symbol(inner, word.end);
     if (string_size(word))
-      CHECK(file_putc(out, '_'));
+      CHECK(buffer_putc(out, '_'));
   }
   write_trailing(out, s, inner);
 
@@ -195,7 +191,7 @@ int generate_upper(FILE *out, String s)
 /**
  * Writes a string to the output file, converting it to CamelCase
  */
-int generate_camel(FILE *out, String s)
+int generate_camel(Buffer *out, String s)
 {
   String inner = strip_symbol(s);
   String word = scan_symbol(inner, inner.p);
@@ -213,7 +209,7 @@ int generate_camel(FILE *out, String s)
 /**
  * Writes a string to the output file, converting it to mixedCase
  */
-int generate_mixed(FILE *out, String s)
+int generate_mixed(Buffer *out, String s)
 {
   String inner = strip_symbol(s);
   String word = scan_symbol(inner, inner.p);
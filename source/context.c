@@ -0,0 +1,165 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Compiler state. Everything that outlives a single compile, such as the list
+ * of loaded source files and the include cache, lives in a context. The
+ * command-line program only uses the built-in context, while each library
+ * user gets contexts of their own, so compiles in separate contexts can run on
+ * separate threads without touching any of the same data.
+ *
+ * Rather than passing the context through every parser and generator
+ * function, each thread has a current context. A thread that never picks one
+ * gets the built-in context.
+ */
+
+#if defined(WIN32)
+#define vsnprintf _vsnprintf
+#endif
+
+typedef struct Source Source;
+typedef struct Include Include;
+typedef struct OlcMap OlcMap;
+
+/**
+ * Supplies the text of a file on behalf of a library user. Returns 0 if
+ * there is no such file. The text only needs to last until the next call.
+ */
+typedef int (*ContextResolveFn)(void *data, char const *filename,
+  char const **text, size_t *size);
+
+typedef struct {
+  /* Loaded files (source.c): */
+  Source *source_list;
+  Mutex source_lock;
+  int source_run;
+
+  /* Include cache (include.c and olc.c). The lock also covers outlines
+   * and tag values being parsed on first use (parse.c): */
+  Include *include_list;
+  Include *include_parsing;
+  Pool include_pool;
+  RecursiveMutex include_lock;
+  OlcMap *olc_maps;
+
+  /* Output sharding (generate.c): */
+  int shard;                  /* The slice of each sharded loop to generate */
+  int shards;                 /* The number of slices, or 0 to generate all */
+
+  /* Settings for library users: */
+  ContextResolveFn resolve;   /* Supplies source files, or 0 to use the disk */
+  void *resolve_data;
+  Buffer *errors;             /* Collects error messages, or 0 for stderr */
+  jmp_buf *out_of_memory;     /* Where to go if memory runs out, or 0 */
+  ThreadId owner;             /* The thread allowed to go there */
+} Context;
+
+Context context_main = {0, MUTEX_INIT, 1, 0, 0, {0, 0, 0}, RECURSIVE_MUTEX_INIT};
+Once context_once = ONCE_INIT;
+ThreadKey context_key;
+int context_key_ok = 0;
+
+static void context_key_init(void)
+{
+  context_key_ok = thread_key_init(&context_key);
+}
+
+/**
+ * Returns the calling thread's current context.
+ */
+Context *context_get(void)
+{
+  Context *self;
+
+  thread_once(&context_once, context_key_init);
+  if (!context_key_ok) return &context_main;
+  self = (Context*)thread_key_get(context_key);
+  return self ? self : &context_main;
+}
+
+/**
+ * Makes a context current on the calling thread, returning the old one.
+ * Returns 0 if the platform cannot keep track of per-thread contexts.
+ */
+Context *context_set(Context *self)
+{
+  Context *old = context_get();
+  if (!context_key_ok) return 0;
+  thread_key_set(context_key, self);
+  return old;
+}
+
+void context_init(Context *self)
+{
+  memset(self, 0, sizeof(*self));
+  mutex_init(&self->source_lock);
+  self->source_run = 1;
+  rmutex_init(&self->include_lock);
+}
+
+/**
+ * Releases a context's locks. The include cache belongs to include_free.
+ */
+void context_free(Context *self)
+{
+  rmutex_free(&self->include_lock);
+  mutex_free(&self->source_lock);
+}
+
+/**
+ * Reports an error, either on stderr or in the library user's buffer.
+ */
+void context_error(char const *format, ...)
+{
+  Context *self = context_get();
+  va_list args;
+  size_t room;
+  int n;
+
+  if (!self->errors) {
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    return;
+  }
+
+  /* Keep growing the buffer until the message fits, with its terminator: */
+  room = 0x100;
+  while (buffer_reserve(self->errors, room)) {
+    room = self->errors->cap - self->errors->end;
+    va_start(args, format);
+    n = vsnprintf(self->errors->end, room, format, args);
+    va_end(args);
+    if (0 <= n && (size_t)n < room) {
+      self->errors->end += n;
+      return;
+    }
+    room = 0 <= n ? n + 1 : 2*room;
+  }
+}
+
+/**
+ * Handles an allocation failure. Library calls arrange to return an error,
+ * but anything else simply stops the program.
+ */
+void memory_error(char const *file, int line)
+{
+  Context *self = context_get();
+
+  if (self->out_of_memory && thread_equal(self->owner, thread_self()))
+    longjmp(*self->out_of_memory, 1);
+  fprintf(stderr, "error: Out of memory at %s:%d\n", file, line);
+  abort();
+}
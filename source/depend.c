@@ -0,0 +1,181 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Dependency tracking for build systems. Every file the compiler reads goes
+ * through source_load, so the global source list doubles as a record of the
+ * files an output depends on. Files the include cache kept from an earlier
+ * run are stamped again when a later run uses them. These routines write
+ * that record out as a make-style rule, the same format gcc produces with
+ * -MD.
+ *
+ * Like the include cache, these routines identify files by device and inode
+ * number, so one file reached through two different paths only counts once.
+ */
+
+/**
+ * Determines whether the given file was loaded before `self` during the
+ * current run. The source list runs from newest to oldest.
+ */
+static int depend_seen(Source *self, String filename, int run)
+{
+  Context *context = context_get();
+  FileKey key;
+
+  if (!context->resolve && !file_key(&key, filename.p))
+    return 0;
+  for (self = self->next; self; self = self->next)
+    if (self->run == run && include_same(context, self->filename, &key, filename))
+      return 1;
+  return 0;
+}
+
+/**
+ * Writes a file name, escaping the characters make treats specially.
+ */
+static void depend_write_name(FILE *file, String name)
+{
+  char const *p;
+  for (p = name.p; p < name.end; ++p) {
+    if (*p == ' ' || *p == '#')
+      fputc('\\', file);
+    else if (*p == '$')
+      fputc('$', file);
+    fputc(*p, file);
+  }
+}
+
+/**
+ * Writes the dependencies in the order the files were loaded.
+ */
+static void depend_write_list(FILE *file, Source *self, int run)
+{
+  if (!self) return;
+  depend_write_list(file, self->next, run);
+
+  if (self->run != run || depend_seen(self, self->filename, run)) return;
+  fputs(" \\\n  ", file);
+  depend_write_name(file, self->filename);
+}
+
+/**
+ * Writes a make rule listing every loaded source file as a dependency of the
+ * target. A file name of "-" means standard output.
+ */
+int depend_write(Pool *pool, String target, String filename)
+{
+  Context *context = context_get();
+  int rv;
+  FILE *file = stdout;
+
+  if (!string_equal(filename, string_from_k("-"))) {
+    file = fopen(string_copy(pool, filename).p, "wb");
+    if (!file) {
+      fprintf(stderr, "error: Could not open dependency file \"%s\"\n",
+        string_copy(pool, filename).p);
+      return 0;
+    }
+  }
+
+  depend_write_name(file, target);
+  fputc(':', file);
+  mutex_lock(&context->source_lock);
+  depend_write_list(file, context->source_list, context->source_run);
+  mutex_unlock(&context->source_lock);
+  fputc('\n', file);
+
+  rv = !ferror(file);
+  if (file != stdout)
+    rv = !fclose(file) && rv;
+  else
+    rv = !fflush(file) && rv;
+  if (!rv)
+    fprintf(stderr, "error: Could not write dependency file \"%s\"\n",
+      string_copy(pool, filename).p);
+  return rv;
+}
+
+/**
+ * Finds the files a source file includes, without parsing or generating
+ * anything. This only looks for `\ol include "file"` sequences, so it picks
+ * up includes everywhere, including ones inside macro bodies that might
+ * never run. That is the right way to err for a dependency list.
+ */
+int depend_scan(Pool *pool, Source *in)
+{
+  Context *context = context_get();
+  char const *start;
+  Token token;
+  char const *p = in->data.p;
+
+  while (1) {
+    token = lex(&p, in->data.end);
+    if (token == LEX_END) break;
+    if (token != LEX_ESCAPE) continue;
+
+    token = lex_next(&start, &p, in->data.end);
+    if (token == LEX_IDENTIFIER &&
+      string_equal(string(start, p), string_from_k("include"))) {
+      String filename;
+      Source *source;
+      FileKey key;
+
+      token = lex_next(&start, &p, in->data.end);
+      if (token != LEX_STRING)
+        return source_error(start, "An include statment expects a quoted filename.");
+      filename = source_path(pool, in->filename, string(start + 1, p - 1));
+
+      /* Each file only needs scanning once, however it is named: */
+      if (!context->resolve && !file_key(&key, filename.p))
+        return source_error(start, "Could not open the included file.");
+      mutex_lock(&context->source_lock);
+      for (source = context->source_list; source; source = source->next)
+        if (source->run == context->source_run &&
+          include_same(context, source->filename, &key, filename))
+          break;
+      mutex_unlock(&context->source_lock);
+      if (source) continue;
+
+      source = source_load(pool, filename);
+      if (!source)
+        return source_error(start, "Could not open the included file.");
+      CHECK(depend_scan(pool, source));
+    }
+  }
+  return 1;
+}
+
+/**
+ * Determines whether a source file contains any output statements, using the
+ * same quick scan as depend_scan. Like that scan, this can be fooled into
+ * saying yes by a statement that would never run.
+ */
+int depend_has_outputs(Source *in)
+{
+  char const *start;
+  Token token;
+  char const *p = in->data.p;
+
+  while (1) {
+    token = lex(&p, in->data.end);
+    if (token == LEX_END) return 0;
+    if (token != LEX_ESCAPE) continue;
+
+    token = lex_next(&start, &p, in->data.end);
+    if (token == LEX_IDENTIFIER &&
+      string_equal(string(start, p), string_from_k("output")))
+      return 1;
+  }
+}
@@ -113,9 +113,9 @@ void dump_outline_items(AstOutline *p, int indent);
 void dump_outline_tag(AstOutlineTag *p, int indent)
 {
   dump_text(p->name);
-  if (p->value) {
+  if (p->text.p) {
     printf("={");
-    dump_code(p->value, indent);
+    dump_text(p->text);
     printf("}");
   }
 }
@@ -138,7 +138,7 @@ void dump_outline_item(AstOutlineItem *p, int indent)
   dump_text(p->name);
 
   /* Children: */
-  if (p->children && p->children->items)
+  if (p->children && parse_outline_body(p->children) && p->children->items)
     dump_outline_items(p->children, indent);
   else
     printf(";");
@@ -148,6 +148,10 @@ void dump_outline_items(AstOutline *p, int indent)
 {
   ListNode *item;
 
+  if (!parse_outline_body(p)) {
+    printf(" {...}");
+    return;
+  }
   printf(" {\n");
   for (item = p->items; item; item = item->next) {
     dump_outline_item(ast_to_outline_item(item->d), indent + INDENT);
@@ -162,6 +166,13 @@ void dump_outline_items(AstOutline *p, int indent)
  */
 void dump_outline(AstOutline *p, int indent)
 {
+  if (p->source.type == type_range) {
+    AstRange *range = p->source.p;
+    printf("range(%ld, %ld, ", range->first, range->end);
+    dump_text(range->prefix);
+    printf(")");
+    return;
+  }
   printf("outline");
   dump_outline_items(p, indent);
 }
@@ -211,6 +222,15 @@ void dump_for(AstFor *p)
     printf(" reverse");
   if (p->list)
     printf(" list");
+  if (p->shard)
+    printf(" shard");
+  if (p->sorted) {
+    printf(" sorted");
+    if (p->sort_tag.p) {
+      printf(" by ");
+      dump_text(p->sort_tag);
+    }
+  }
 
   printf(" {");
   dump_text(string(p->code.cursor, p->code.data.end));
@@ -222,19 +242,71 @@ void dump_code_text(AstCodeText *p)
   dump_text(p->code);
 }
 
+/**
+ * Prints an output statement.
+ */
+void dump_output(AstOutput *p)
+{
+  printf("\\ol output \"");
+  dump_text(p->filename);
+  printf("\" {");
+  dump_code(p->code, 1);
+  printf("}");
+}
+
 void dump(Dynamic node, int indent)
 {
-  if (node.type == type_lookup)      dump_lookup(node.p); return;
-  if (node.type == type_macro_call)  dump_macro_call(node.p); return;
-  if (node.type == type_outline_item)dump_outline_item(node.p, indent); return;
-  if (node.type == type_filter_tag)  dump_filter_tag(node.p); return;
-  if (node.type == type_filter_any)  dump_filter_any(node.p); return;
-  if (node.type == type_filter_not)  dump_filter_not(node.p); return;
-  if (node.type == type_filter_and)  dump_filter_and(node.p); return;
-  if (node.type == type_filter_or)   dump_filter_or(node.p); return;
-  if (node.type == type_outline)     dump_outline(node.p, indent); return;
-  if (node.type == type_map)         dump_map(node.p); return;
-  if (node.type == type_for)         dump_for(node.p); return;
-  if (node.type == type_code_text)   dump_code_text(node.p); return;
+  if (node.type == type_lookup) {
+    dump_lookup(node.p);
+    return;
+  }
+  if (node.type == type_macro_call) {
+    dump_macro_call(node.p);
+    return;
+  }
+  if (node.type == type_outline_item) {
+    dump_outline_item(node.p, indent);
+    return;
+  }
+  if (node.type == type_filter_tag) {
+    dump_filter_tag(node.p);
+    return;
+  }
+  if (node.type == type_filter_any) {
+    dump_filter_any(node.p);
+    return;
+  }
+  if (node.type == type_filter_not) {
+    dump_filter_not(node.p);
+    return;
+  }
+  if (node.type == type_filter_and) {
+    dump_filter_and(node.p);
+    return;
+  }
+  if (node.type == type_filter_or) {
+    dump_filter_or(node.p);
+    return;
+  }
+  if (node.type == type_outline) {
+    dump_outline(node.p, indent);
+    return;
+  }
+  if (node.type == type_map) {
+    dump_map(node.p);
+    return;
+  }
+  if (node.type == type_for) {
+    dump_for(node.p);
+    return;
+  }
+  if (node.type == type_code_text) {
+    dump_code_text(node.p);
+    return;
+  }
+  if (node.type == type_output) {
+    dump_output(node.p);
+    return;
+  }
   printf("<Unknown node>");
 }
@@ -39,7 +39,15 @@ typedef enum {
   type_map_line,
   type_map,
   type_for,
-  type_code_text
+  type_code_text,
+  type_output,
+  type_union_part,
+  type_union,
+  type_range,
+  type_group,
+  type_join,
+  type_perfect_hash,
+  type_outline_load
 } Type;
 
 typedef struct {
@@ -0,0 +1,222 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Helpers for replacing output files. Build tools decide what to rebuild by
+ * looking at modification times, so an output file should only be touched
+ * when its contents really change, and then all at once, so nobody ever sees
+ * a half-written file.
+ */
+
+/**
+ * Determines whether a file exists and holds exactly the given bytes.
+ */
+int file_equal(char const *filename, char const *p, char const *end)
+{
+  struct stat st;
+  FILE *file;
+  char chunk[0x10000];
+  int same = 1;
+
+  /* Comparing sizes is enough to catch most changes: */
+  if (stat(filename, &st) || (size_t)st.st_size != (size_t)(end - p))
+    return 0;
+
+  file = fopen(filename, "rb");
+  if (!file) return 0;
+  while (same && p < end) {
+    size_t size = sizeof(chunk) < (size_t)(end - p) ? sizeof(chunk) : end - p;
+    same = fread(chunk, 1, size, file) == size && !memcmp(chunk, p, size);
+    p += size;
+  }
+  fclose(file);
+  return same;
+}
+
+/**
+ * Reads a file's modification time as precisely as the platform allows, since
+ * a file and the things made from it are often written within one second.
+ */
+uint64_t file_mtime(struct stat *st)
+{
+#if defined(WIN32)
+  return (uint64_t)st->st_mtime;
+#else
+  return (uint64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * Creates a temporary file in the same directory as the given file, so it can
+ * later replace that file with a simple rename. The new file gets the same
+ * permissions the original has, or would have if it were newly created.
+ * Returns the open file descriptor, or -1 for failure.
+ */
+int file_temp(Pool *pool, String filename, String *temp)
+{
+  struct stat st;
+  int fd;
+
+#if defined(WIN32)
+  *temp = string_cat(pool, filename, string_from_k(".tmp"));
+  fd = _open(temp->p, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+    _S_IREAD | _S_IWRITE);
+  (void)st;
+#else
+  mode_t mode;
+
+  *temp = string_cat(pool, filename, string_from_k(".XXXXXX"));
+  fd = mkstemp((char*)temp->p);
+  if (fd < 0) return -1;
+
+  if (!stat(string_copy(pool, filename).p, &st)) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+  fchmod(fd, mode);
+#endif
+  return fd;
+}
+
+/**
+ * Moves a temporary file over the top of the real one.
+ */
+int file_replace(char const *temp, char const *filename)
+{
+#if defined(WIN32)
+  if (MoveFileExA(temp, filename, MOVEFILE_REPLACE_EXISTING))
+    return 1;
+#else
+  if (!rename(temp, filename))
+    return 1;
+#endif
+  remove(temp);
+  return 0;
+}
+
+/**
+ * Writes a block of text to a file. The text goes into a temporary file
+ * first, which then replaces the real file in one step.
+ */
+int file_write(Pool *pool, String filename, char const *p, char const *end)
+{
+  String temp;
+  FILE *file;
+  int fd, rv;
+
+  filename = string_copy(pool, filename);
+  fd = file_temp(pool, filename, &temp);
+  file = fd < 0 ? 0 : fdopen(fd, "wb");
+  if (!file) {
+    fprintf(stderr, "error: Could not open output file \"%s\"\n", filename.p);
+    return 0;
+  }
+
+  rv = fwrite(p, 1, end - p, file) == (size_t)(end - p);
+  rv = !fclose(file) && rv;
+  if (!rv || !file_replace(temp.p, filename.p)) {
+    fprintf(stderr, "error: Could not write output file \"%s\"\n", filename.p);
+    remove(temp.p);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Puts a block of text in a file, unless the file already holds exactly that
+ * text. The name "-" means standard output, which always gets the text.
+ */
+int file_update(Pool *pool, String filename, char const *p, char const *end)
+{
+  filename = string_copy(pool, filename);
+  if (string_equal(filename, string_from_k("-"))) {
+#if defined(WIN32)
+    fflush(stdout);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    if (fwrite(p, 1, end - p, stdout) != (size_t)(end - p) || fflush(stdout)) {
+      fprintf(stderr, "error: Could not write to standard output\n");
+      return 0;
+    }
+    return 1;
+  }
+  return file_equal(filename.p, p, end) || file_write(pool, filename, p, end);
+}
+
+/**
+ * Reads everything left in a stream, which might be a pipe or terminal with
+ * no size known up front. The memory grows as needed, and shrinks to fit at
+ * the end. Returns 0 if the stream cannot be read.
+ */
+int file_read_stream(Pool *pool, FILE *file, String *out)
+{
+  size_t size = 0, cap = 0x10000, n;
+  char *p = (char*)pool_alloc_sys(pool, cap + 1, 1);
+
+  while ((n = fread(p + size, 1, cap - size, file))) {
+    size += n;
+    if (size == cap) {
+      cap *= 2;
+      p = (char*)pool_realloc_sys(pool, p, cap + 1, 1);
+    }
+  }
+  if (ferror(file)) return 0;
+
+  p = (char*)pool_realloc_sys(pool, p, size + 1, 1);
+  p[size] = 0;
+  *out = string(p, p + size);
+  return 1;
+}
+
+/**
+ * Reads a whole file into memory. Regular files are read in one go, since
+ * their size is known, while anything else gets read as a stream. Returns 0
+ * if the file cannot be read.
+ */
+int file_read(Pool *pool, char const *filename, String *out)
+{
+  struct stat st;
+  FILE *file;
+  size_t size;
+  char *p;
+  int rv;
+
+  if (stat(filename, &st)) return 0;
+  file = fopen(filename, "rb");
+  if (!file) return 0;
+
+  if (!S_ISREG(st.st_mode)) {
+    rv = file_read_stream(pool, file, out);
+    fclose(file);
+    return rv;
+  }
+
+  /* Files too big to address are not an option on 32-bit systems: */
+  size = (size_t)st.st_size;
+  if ((uint64_t)size != (uint64_t)st.st_size) {
+    fclose(file);
+    return 0;
+  }
+
+  p = (char*)pool_alloc(pool, size + 1, 1);
+  rv = fread(p, 1, size, file) == size;
+  fclose(file);
+  p[size] = 0;
+  *out = string(p, p + size);
+  return rv;
+}
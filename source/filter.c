@@ -59,6 +59,79 @@ int test_filter(Dynamic test, AstOutlineItem *item)
   return 0;
 }
 
+String filter_key(Pool *pool, Dynamic test);
+
+/**
+ * Gathers the keys for the terms of a chain of & or | operators.
+ */
+static void filter_key_terms(Pool *pool, Dynamic test, Type type, String *terms, int *count)
+{
+  if (test.type != type) {
+    terms[(*count)++] = filter_key(pool, test);
+  } else if (type == type_filter_and) {
+    filter_key_terms(pool, ((AstFilterAnd*)test.p)->test_a, type, terms, count);
+    filter_key_terms(pool, ((AstFilterAnd*)test.p)->test_b, type, terms, count);
+  } else {
+    filter_key_terms(pool, ((AstFilterOr*)test.p)->test_a, type, terms, count);
+    filter_key_terms(pool, ((AstFilterOr*)test.p)->test_b, type, terms, count);
+  }
+}
+
+static int filter_key_compare(void const *a, void const *b)
+{
+  String const *sa = a;
+  String const *sb = b;
+  size_t na = string_size(*sa), nb = string_size(*sb);
+  int rv = memcmp(sa->p, sb->p, na < nb ? na : nb);
+  return rv ? rv : na < nb ? -1 : nb < na;
+}
+
+static int filter_key_size(Dynamic test)
+{
+  if (test.type == type_filter_and)
+    return filter_key_size(((AstFilterAnd*)test.p)->test_a) +
+      filter_key_size(((AstFilterAnd*)test.p)->test_b);
+  if (test.type == type_filter_or)
+    return filter_key_size(((AstFilterOr*)test.p)->test_a) +
+      filter_key_size(((AstFilterOr*)test.p)->test_b);
+  return 1;
+}
+
+/**
+ * Writes a filter out in a standard form, so filters which only differ in
+ * the order or repetition of their & and | terms, or in double negatives,
+ * come out the same.
+ */
+String filter_key(Pool *pool, Dynamic test)
+{
+  if (test.type == type_filter_tag) return ((AstFilterTag*)test.p)->tag;
+  if (test.type == type_filter_any) return string_from_k("*");
+  if (test.type == type_filter_not) {
+    Dynamic inner = ((AstFilterNot*)test.p)->test;
+    if (inner.type == type_filter_not)
+      return filter_key(pool, ((AstFilterNot*)inner.p)->test);
+    return string_cat(pool, string_from_k("!"), filter_key(pool, inner));
+  }
+  if (test.type == type_filter_and || test.type == type_filter_or) {
+    String op = test.type == type_filter_and ? string_from_k("&") : string_from_k("|");
+    String *terms;
+    String key = string_from_k("(");
+    int count = 0, i;
+
+    terms = (String*)pool_alloc(pool, filter_key_size(test)*sizeof(String), alignof(String));
+    filter_key_terms(pool, test, test.type, terms, &count);
+    qsort(terms, count, sizeof(String), filter_key_compare);
+    for (i = 0; i < count; ++i) {
+      if (i && string_equal(terms[i], terms[i - 1])) continue;
+      if (i) key = string_cat(pool, key, op);
+      key = string_cat(pool, key, terms[i]);
+    }
+    return string_cat(pool, key, string_from_k(")"));
+  }
+  assert(0);
+  return string_null();
+}
+
 /**
  * A stack for building filters using Dijkstra's shunting-yard algorithm
  */
@@ -15,26 +15,236 @@
  */
 
 /**
- * Extracts an AstOutlineItem list from an AST node
+ * Extracts an AstOutlineItem list from an AST node, parsing the outline
+ * first if nothing has needed it before.
  */
-ListNode *get_items(Dynamic node)
+int get_items(Dynamic node, ListNode **items)
 {
+  AstOutline *outline;
+
   if (node.type == type_outline_item) {
-    AstOutlineItem *item = node.p;
-    return item->children ? item->children->items : 0;
+    outline = ((AstOutlineItem*)node.p)->children;
   } else if (node.type == type_outline) {
-    AstOutline *outline = node.p;
-    return outline->items;
+    outline = node.p;
   } else {
     assert(0);
     return 0;
   }
+
+  *items = 0;
+  if (outline) {
+    CHECK(parse_outline_body(outline));
+    *items = outline->items;
+  }
+  return 1;
+}
+
+/**
+ * Extracts the items from an AST node which pass a filter. The outline keeps
+ * the result, so loops and unions which select the same items from the same
+ * outline only run the filter once. Like the parsed items, the result lives
+ * in the outline's pool, under the include lock.
+ */
+int get_filtered_items(Pool *pool, Dynamic node, Dynamic filter, ListNode **items)
+{
+  Context *context = context_get();
+  AstOutline *outline;
+  AstSubset *subset;
+  String key;
+  ListNode *item;
+
+  CHECK(get_items(node, items));
+  if (!dynamic_ok(filter) || !*items) return 1;
+  outline = node.type == type_outline ? node.p : ((AstOutlineItem*)node.p)->children;
+  key = filter_key(pool, filter);
+
+  rmutex_lock(&context->include_lock);
+  for (subset = outline->subsets; subset; subset = subset->next)
+    if (string_equal(subset->filter, key))
+      break;
+  if (!subset) {
+    ListBuilder b = list_builder_init(outline->pool);
+    for (item = *items; item; item = item->next)
+      if (test_filter(filter, ast_to_outline_item(item->d)))
+        list_builder_add(&b, item->d);
+    subset = pool_new(outline->pool, AstSubset);
+    subset->filter = string_copy(outline->pool, key);
+    subset->items = b.first;
+    subset->next = outline->subsets;
+    outline->subsets = subset;
+  }
+  *items = subset->items;
+  rmutex_unlock(&context->include_lock);
+  return 1;
+}
+
+/**
+ * An item and its sort key.
+ */
+typedef struct {
+  ListNode *item;
+  String key;
+  long number;
+  int has_key;
+  size_t index;   /* The original position, which keeps the sort stable */
+} SortEntry;
+
+/**
+ * Reads a sort key as a C integer, if it is one.
+ */
+static int sort_number(String key, long *n)
+{
+  char number[32];
+  char *end;
+
+  if (!string_size(key) || sizeof(number) <= string_size(key))
+    return 0;
+  memcpy(number, key.p, string_size(key));
+  number[string_size(key)] = 0;
+  errno = 0;
+  *n = strtol(number, &end, 0);
+  return !*end && !errno;
+}
+
+static int sort_compare_text(void const *a, void const *b)
+{
+  SortEntry const *sa = a, *sb = b;
+  size_t size_a, size_b;
+  int rv;
+
+  if (sa->has_key != sb->has_key) return sb->has_key - sa->has_key;
+  rv = 0;
+  if (sa->has_key) {
+    size_a = string_size(sa->key);
+    size_b = string_size(sb->key);
+    rv = memcmp(sa->key.p, sb->key.p, size_a < size_b ? size_a : size_b);
+    if (!rv) rv = size_a < size_b ? -1 : size_b < size_a;
+  }
+  if (!rv) rv = sa->index < sb->index ? -1 : sb->index < sa->index;
+  return rv;
+}
+
+static int sort_compare_number(void const *a, void const *b)
+{
+  SortEntry const *sa = a, *sb = b;
+
+  if (sa->has_key != sb->has_key) return sb->has_key - sa->has_key;
+  if (sa->number != sb->number) return sa->number < sb->number ? -1 : 1;
+  return sa->index < sb->index ? -1 : sb->index < sa->index;
+}
+
+/**
+ * Sorts a list of items by name, or by the value of a tag, into an array of
+ * list nodes. The list itself stays as it is. If every key is a C integer,
+ * the keys sort as numbers, and otherwise as text. Items without a value for
+ * the tag go last. Equal keys keep their original order. Returns 0 if a tag
+ * value cannot be generated.
+ */
+ListNode **sort_items(Pool *pool, ListNode *items, String tag, size_t *count)
+{
+  SortEntry *entries;
+  ListNode **order;
+  ListNode *item;
+  int numeric = 1;
+  size_t i;
+
+  *count = list_length(items);
+  entries = (SortEntry*)malloc((*count + 1)*sizeof(SortEntry));
+  CHECK_MEMORY(entries);
+  for (item = items, i = 0; item; item = item->next, ++i) {
+    SortEntry *e = &entries[i];
+    e->item = item;
+    e->index = i;
+    e->number = 0;
+    if (!join_key(pool, ast_to_outline_item(item->d), tag, &e->key)) {
+      free(entries);
+      return 0;
+    }
+    e->has_key = !!e->key.p;
+    if (e->has_key && numeric)
+      numeric = sort_number(e->key, &e->number);
+  }
+  qsort(entries, *count, sizeof(SortEntry),
+    numeric ? sort_compare_number : sort_compare_text);
+
+  order = (ListNode**)pool_alloc(pool, (*count + 1)*sizeof(ListNode*), alignof(ListNode*));
+  for (i = 0; i < *count; ++i)
+    order[i] = entries[i].item;
+  free(entries);
+  return order;
+}
+
+/**
+ * Sorts the items from an AST node. The outline keeps the sorted order for
+ * each tag, so sorting the same outline again costs nothing.
+ */
+int get_sorted_items(Dynamic node, String tag, ListNode ***items, size_t *count)
+{
+  Context *context = context_get();
+  AstOutline *outline;
+  AstOrder *order;
+  ListNode *list;
+
+  CHECK(get_items(node, &list));
+  *items = 0;
+  *count = 0;
+  if (!list) return 1;
+  outline = node.type == type_outline ? node.p : ((AstOutlineItem*)node.p)->children;
+
+  rmutex_lock(&context->include_lock);
+  for (order = outline->orders; order; order = order->next)
+    if (!order->tag.p == !tag.p && string_equal(order->tag, tag))
+      break;
+  if (!order) {
+    order = pool_new(outline->pool, AstOrder);
+    order->tag = tag.p ? string_copy(outline->pool, tag) : tag;
+    order->items = sort_items(outline->pool, list, tag, &order->count);
+    if (!order->items) {
+      rmutex_unlock(&context->include_lock);
+      return 0;
+    }
+    order->next = outline->orders;
+    outline->orders = order;
+  }
+  *items = order->items;
+  *count = order->count;
+  rmutex_unlock(&context->include_lock);
+  return 1;
+}
+
+/**
+ * Finds the first item with a given name in an AST node, or sets the item to
+ * 0 if there is none. The first lookup builds a hash index of the items,
+ * which the outline keeps alongside them.
+ */
+int get_item_by_name(Dynamic node, String name, AstOutlineItem **item)
+{
+  Context *context = context_get();
+  AstOutline *outline;
+  ListNode *items, *i;
+
+  CHECK(get_items(node, &items));
+  *item = 0;
+  if (!items) return 1;
+  outline = node.type == type_outline ? node.p : ((AstOutlineItem*)node.p)->children;
+
+  rmutex_lock(&context->include_lock);
+  if (!outline->index) {
+    HashTable *index = pool_new(outline->pool, HashTable);
+    hash_table_init(index, outline->pool, list_length(items));
+    for (i = items; i; i = i->next)
+      hash_table_add(index, ast_to_outline_item(i->d)->name, i->d.p);
+    outline->index = index;
+  }
+  *item = hash_table_get(outline->index, name);
+  rmutex_unlock(&context->include_lock);
+  return 1;
 }
 
 /**
  * Processes source code, writing the result to the output file.
  */
-int generate_code(Pool *pool, FILE *out, ListNode *node)
+int generate_code(Pool *pool, Buffer *out, ListNode *node)
 {
   for (; node; node = node->next)
     CHECK(generate(pool, out, node->d));
@@ -46,13 +256,14 @@ int generate_code(Pool *pool, FILE *out, ListNode *node)
  * exists and has a value, the function emits the value and returns 1.
  * Otherwise, the function returns -1. Returns 0 for errors.
  */
-int generate_lookup_tag(Pool *pool, FILE *out, AstLookup *p)
+int generate_lookup_tag(Pool *pool, Buffer *out, AstLookup *p)
 {
   ListNode *tag;
 
   for (tag = p->item->tags; tag; tag = tag->next) {
     AstOutlineTag *t = ast_to_outline_tag(tag->d);
-    if (t->value && string_equal(t->name, p->name)) {
+    if (t->text.p && string_equal(t->name, p->name)) {
+      CHECK(parse_tag_value(t));
       CHECK(generate_code(pool, out, t->value));
       return 1;
     }
@@ -65,12 +276,12 @@ int generate_lookup_tag(Pool *pool, FILE *out, AstLookup *p)
  * If the lookup name matches one of the built-in transformations, generate
  * that and return 1. Otherwise, return 0.
  */
-int generate_lookup_builtin(Pool *pool, FILE *out, AstLookup *p)
+int generate_lookup_builtin(Pool *pool, Buffer *out, AstLookup *p)
 {
   if (string_equal(p->name, string_from_k("quote"))) {
-    CHECK(file_putc(out, '"'));
-    CHECK(file_write(out, p->item->name.p, p->item->name.end));
-    CHECK(file_putc(out, '"'));
+    CHECK(buffer_putc(out, '"'));
+    CHECK(buffer_write(out, p->item->name.p, p->item->name.end));
+    CHECK(buffer_putc(out, '"'));
     return 1;
   } else if (string_equal(p->name, string_from_k("lower"))) {
     return generate_lower(out, p->item->name);
@@ -88,7 +299,7 @@ int generate_lookup_builtin(Pool *pool, FILE *out, AstLookup *p)
 /**
  * Performs code-generation for a lookup node.
  */
-int generate_lookup(Pool *pool, FILE *out, AstLookup *p)
+int generate_lookup(Pool *pool, Buffer *out, AstLookup *p)
 {
   int rv;
 
@@ -101,16 +312,17 @@ int generate_lookup(Pool *pool, FILE *out, AstLookup *p)
   if (generate_lookup_builtin(pool, out, p))
     return 1;
 
-  source_location(stderr, p->name.p);
-  fprintf(stderr, "error: Could not find a transform named \"%s\".\n",
+  source_location(p->name.p);
+  context_error("error: Could not find a transform named \"%s\".\n",
     string_copy(pool, p->name).p);
   return 0;
 }
 
-int generate_macro_call(Pool *pool, FILE *out, AstMacroCall *p)
+int generate_macro_call(Pool *pool, Buffer *out, AstMacroCall *p)
 {
   ListNode *call_input;
   ListNode *macro_input;
+  Source in = p->macro->code; /* Private cursor, for thread safety */
   Scope *scope = scope_new(pool, p->macro->scope);
   ListBuilder code = list_builder_init(pool);
 
@@ -125,21 +337,21 @@ int generate_macro_call(Pool *pool, FILE *out, AstMacroCall *p)
     call_input = call_input->next;
   }
 
-  CHECK(parse_code(pool, &p->macro->code, scope, out_list_builder(&code)));
+  CHECK(parse_code(pool, &in, scope, out_list_builder(&code)));
   CHECK(generate_code(pool, out, code.first));
   return 1;
 }
 
-int generate_outline_item(Pool *pool, FILE *out, AstOutlineItem *p)
+int generate_outline_item(Pool *pool, Buffer *out, AstOutlineItem *p)
 {
-  CHECK(file_write(out, p->name.p, p->name.end));
+  CHECK(buffer_write(out, p->name.p, p->name.end));
   return 1;
 }
 
 /**
  * Performs code-generation for a map statement.
  */
-int generate_map(Pool *pool, FILE *out, AstMap *p)
+int generate_map(Pool *pool, Buffer *out, AstMap *p)
 {
   ListNode *line;
 
@@ -153,69 +365,224 @@ int generate_map(Pool *pool, FILE *out, AstMap *p)
   }
 
   /* Nothing matched: */
-  fprintf(stderr, "error: Could not match item \"%s\" against map.\n",
+  context_error("error: Could not match item \"%s\" against map.\n",
     string_copy(pool, p->item->name).p);
   return 0;
 }
 
-int generate_for_item(Pool *pool, FILE *out, AstFor *p, ListNode *item, int *need_comma)
+int generate_for_item(Pool *pool, Buffer *out, AstFor *p, ListNode *item, int *need_comma)
 {
+  Source in = p->code; /* Private cursor, for thread safety */
   Scope *scope = scope_new(pool, p->scope);
   ListBuilder code = list_builder_init(pool);
 
-  if (dynamic_ok(p->filter) &&
-    !test_filter(p->filter, ast_to_outline_item(item->d)))
-    return 1;
-
   if (p->list && *need_comma)
-    CHECK(file_putc(out, ','));
+    CHECK(buffer_putc(out, ','));
   *need_comma = 1;
 
   scope_add(scope, pool, p->item, item->d);
-  CHECK(parse_code(pool, &p->code, scope, out_list_builder(&code)));
+  CHECK(parse_code(pool, &in, scope, out_list_builder(&code)));
   CHECK(generate_code(pool, out, code.first));
   return 1;
 }
 
 /**
- * Performs code-generation for a for statement node
+ * Runs a for statement over a union one part at a time, so the union's items
+ * never need gathering into one list.
  */
-int generate_for(Pool *pool, FILE *out, AstFor *p)
+int generate_for_parts(Pool *pool, Buffer *out, AstFor *p, AstUnion *self, int *need_comma)
 {
-  ListNode *items = get_items(p->outline);
+  ListNode *part, *item;
+
+  for (part = self->parts; part; part = part->next) {
+    AstUnionPart *u = part->d.p;
+    AstUnion *inner = 0;
+
+    if (u->outline.type == type_outline &&
+      ((AstOutline*)u->outline.p)->source.type == type_union)
+      inner = ((AstOutline*)u->outline.p)->source.p;
+    if (inner && !inner->distinct && !inner->sorted && !dynamic_ok(u->filter)) {
+      CHECK(generate_for_parts(pool, out, p, inner, need_comma));
+      continue;
+    }
+    CHECK(get_filtered_items(pool, u->outline, u->filter, &item));
+    for (; item; item = item->next)
+      if (!dynamic_ok(p->filter) || test_filter(p->filter, ast_to_outline_item(item->d)))
+        CHECK(generate_for_item(pool, out, p, item, need_comma));
+  }
+  return 1;
+}
+
+/**
+ * Runs a for statement over a range, making each item as it goes, so the
+ * range's items never all exist at once. Like the other loops, a sharded
+ * loop splits up the items that pass the filter, so a filtered, sharded
+ * loop makes one extra pass to count them.
+ */
+int generate_for_range(Pool *pool, Buffer *out, AstFor *p, AstRange *range)
+{
+  Context *context = context_get();
+  long total = range->end - range->first;
+  long count = total, begin, end, i, j;
   int need_comma = 0;
+  ListNode item;
+
+  /* Filter: */
+  if (dynamic_ok(p->filter) && p->shard && context->shards)
+    for (i = 0, count = 0; i < total; ++i)
+      if (test_filter(p->filter, ast_range_item(pool, range, range->first + i)))
+        ++count;
+
+  begin = 0;
+  end = count;
+  if (p->shard && context->shards) {
+    begin = (long)((uint64_t)count*context->shard/context->shards);
+    end = (long)((uint64_t)count*(context->shard + 1)/context->shards);
+  }
+
+  /* Without a filter, the slice's items are easy to find: */
+  item.next = 0;
+  if (!dynamic_ok(p->filter)) {
+    for (i = 0; i < end - begin; ++i) {
+      long n = range->first + (p->reverse ? end - 1 - i : begin + i);
+      item.d = dynamic(type_outline_item, ast_range_item(pool, range, n));
+      CHECK(generate_for_item(pool, out, p, &item, &need_comma));
+    }
+    return 1;
+  }
+
+  /* Otherwise, j is the item's position among the ones that pass: */
+  for (i = 0, j = 0; i < total; ++i) {
+    long n = range->first + (p->reverse ? total - 1 - i : i);
+    long k = p->reverse ? count - 1 - j : j;
+    if (p->reverse ? k < begin : end <= k) break;
+    item.d = dynamic(type_outline_item, ast_range_item(pool, range, n));
+    if (!test_filter(p->filter, item.d.p)) continue;
+    ++j;
+    if (begin <= k && k < end)
+      CHECK(generate_for_item(pool, out, p, &item, &need_comma));
+  }
+  return 1;
+}
+
+/**
+ * Runs a sorted for statement, using the outline's sorted order.
+ */
+int generate_for_sorted(Pool *pool, Buffer *out, AstFor *p)
+{
+  Context *context = context_get();
+  ListNode **order, **items;
+  size_t total, count, begin, end, i;
+  int need_comma = 0;
+
+  CHECK(get_sorted_items(p->outline, p->sort_tag, &order, &total));
+
+  /* Filter: */
+  items = order;
+  count = total;
+  if (dynamic_ok(p->filter)) {
+    items = (ListNode**)pool_alloc(pool, (total + 1)*sizeof(ListNode*), alignof(ListNode*));
+    for (i = 0, count = 0; i < total; ++i)
+      if (test_filter(p->filter, ast_to_outline_item(order[i]->d)))
+        items[count++] = order[i];
+  }
+
+  begin = 0;
+  end = count;
+  if (p->shard && context->shards) {
+    begin = (size_t)((uint64_t)count*context->shard/context->shards);
+    end = (size_t)((uint64_t)count*(context->shard + 1)/context->shards);
+  }
+
+  for (i = 0; i < end - begin; ++i)
+    CHECK(generate_for_item(pool, out, p,
+      items[p->reverse ? end - 1 - i : begin + i], &need_comma));
+  return 1;
+}
+
+/**
+ * Performs code-generation for a for statement node. When the output is
+ * split into shards, a sharded loop only generates its own slice of the
+ * items. Each shard gets a contiguous run, so the same outline always splits
+ * the same way.
+ */
+int generate_for(Pool *pool, Buffer *out, AstFor *p)
+{
+  Context *context = context_get();
+  Dynamic source = dynamic_none();
+  ListNode *items;
+  int need_comma = 0;
+  int count, begin, end, i;
+
+  if (p->sorted)
+    return generate_for_sorted(pool, out, p);
+  if (p->outline.type == type_outline)
+    source = ((AstOutline*)p->outline.p)->source;
+
+  /* Ranges never need gathering up: */
+  if (source.type == type_range)
+    return generate_for_range(pool, out, p, source.p);
+
+  /* Unions only need gathering up for reversing, sharding, or removing
+   * duplicates: */
+  if (source.type == type_union && !p->reverse && !(p->shard && context->shards)) {
+    AstUnion *u = source.p;
+    if (!u->distinct && !u->sorted)
+      return generate_for_parts(pool, out, p, u, &need_comma);
+  }
+
+  CHECK(get_filtered_items(pool, p->outline, p->filter, &items));
+  count = list_length(items);
+  begin = 0;
+  end = count;
+
+  if (p->shard && context->shards) {
+    begin = (int)((uint64_t)count*context->shard/context->shards);
+    end = (int)((uint64_t)count*(context->shard + 1)/context->shards);
+  }
 
   /* Process the list: */
   if (p->reverse) {
     /* Warning: O(n^2) reversing algorithm */
     ListNode *item, *last = 0;
-    while (items != last) {
+    for (i = count - 1; items != last; --i) {
       item = items;
       while (item->next != last)
         item = item->next;
       last = item;
 
-      CHECK(generate_for_item(pool, out, p, item, &need_comma));
+      if (begin <= i && i < end)
+        CHECK(generate_for_item(pool, out, p, item, &need_comma));
     }
   } else {
     ListNode *item;
-    for (item = items; item; item = item->next)
-      CHECK(generate_for_item(pool, out, p, item, &need_comma));
+    for (item = items, i = 0; item; item = item->next, ++i)
+      if (begin <= i && i < end)
+        CHECK(generate_for_item(pool, out, p, item, &need_comma));
   }
 
   return 1;
 }
 
-int generate_code_text(Pool *pool, FILE *out, AstCodeText *p)
+int generate_code_text(Pool *pool, Buffer *out, AstCodeText *p)
 {
-  CHECK(file_write(out, p->code.p, p->code.end));
+  CHECK(buffer_write(out, p->code.p, p->code.end));
   return 1;
 }
 
+/**
+ * Output statements are split off before generation starts, so meeting one
+ * here means it was somewhere other than the top level of the input.
+ */
+int generate_output(Pool *pool, Buffer *out, AstOutput *p)
+{
+  return source_error(p->start, "An output statement can only appear at the top level of a file.");
+}
+
 /**
  * Processes source code, writing the result to the output file.
  */
-int generate(Pool *pool, FILE *out, Dynamic node)
+int generate(Pool *pool, Buffer *out, Dynamic node)
 {
   if(node.type == type_lookup)      return generate_lookup(pool, out, node.p);
   if(node.type == type_macro_call)  return generate_macro_call(pool, out, node.p);
@@ -223,6 +590,7 @@ int generate(Pool *pool, FILE *out, Dynamic node)
   if(node.type == type_map)         return generate_map(pool, out, node.p);
   if(node.type == type_for)         return generate_for(pool, out, node.p);
   if(node.type == type_code_text)   return generate_code_text(pool, out, node.p);
+  if(node.type == type_output)      return generate_output(pool, out, node.p);
   assert(0);
   return 0;
 }
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Hash tables keyed by strings, using open addressing. Neither kind copies
+ * the strings, so they must outlive the table. This is also where perfect
+ * hashes are worked out for generated code.
+ */
+
+typedef struct {
+  String *slots;      /* Empty slots have a null pointer */
+  size_t cap;         /* Always a power of two */
+  size_t count;
+} HashSet;
+
+/**
+ * The FNV-1a hash of a string, with a seed mixed into the starting value.
+ * Generated code relies on this staying exactly as it is.
+ */
+uint32_t hash_seeded(String s, uint32_t seed)
+{
+  uint32_t hash = seed ^ 2166136261u;
+  char const *p;
+  for (p = s.p; p < s.end; ++p)
+    hash = (hash ^ (unsigned char)*p)*16777619u;
+  return hash;
+}
+
+/**
+ * The FNV-1a hash of a string.
+ */
+uint32_t hash_string(String s)
+{
+  return hash_seeded(s, 0);
+}
+
+/**
+ * Prepares an empty set, with room for the given number of strings before
+ * it needs to grow.
+ */
+void hash_set_init(HashSet *self, size_t size)
+{
+  self->cap = 16;
+  while (self->cap < 2*size)
+    self->cap *= 2;
+  self->slots = (String*)calloc(self->cap, sizeof(String));
+  CHECK_MEMORY(self->slots);
+  self->count = 0;
+}
+
+void hash_set_free(HashSet *self)
+{
+  free(self->slots);
+}
+
+static String *hash_set_find(String *slots, size_t cap, String s)
+{
+  size_t i = hash_string(s) & (cap - 1);
+  while (slots[i].p && !string_equal(slots[i], s))
+    i = (i + 1) & (cap - 1);
+  return &slots[i];
+}
+
+/**
+ * Adds a string to the set. Returns 1 if it was new, or 0 if the set
+ * already held it.
+ */
+int hash_set_add(HashSet *self, String s)
+{
+  String *slot = hash_set_find(self->slots, self->cap, s);
+  if (slot->p) return 0;
+
+  /* Grow at half full, to keep the probe sequences short: */
+  if (self->cap <= 2*(self->count + 1)) {
+    size_t cap = 2*self->cap, i;
+    String *slots = (String*)calloc(cap, sizeof(String));
+    CHECK_MEMORY(slots);
+    for (i = 0; i < self->cap; ++i)
+      if (self->slots[i].p)
+        *hash_set_find(slots, cap, self->slots[i]) = self->slots[i];
+    free(self->slots);
+    self->slots = slots;
+    self->cap = cap;
+    slot = hash_set_find(self->slots, self->cap, s);
+  }
+
+  *slot = s;
+  ++self->count;
+  return 1;
+}
+
+/**
+ * An entry in a HashTable.
+ */
+typedef struct {
+  String key;         /* Empty entries have a null pointer */
+  void *value;
+} HashEntry;
+
+/**
+ * A table from strings to pointers. The table cannot grow, since it is for
+ * things like indexes, which know their size up front and never change, so
+ * it can go in a pool.
+ */
+typedef struct {
+  HashEntry *slots;
+  size_t cap;
+} HashTable;
+
+void hash_table_init(HashTable *self, Pool *pool, size_t size)
+{
+  self->cap = 16;
+  while (self->cap < 2*size)
+    self->cap *= 2;
+  self->slots = (HashEntry*)pool_alloc(pool, self->cap*sizeof(HashEntry), alignof(HashEntry));
+  memset(self->slots, 0, self->cap*sizeof(HashEntry));
+}
+
+static HashEntry *hash_table_find(HashTable *self, String key)
+{
+  size_t i = hash_string(key) & (self->cap - 1);
+  while (self->slots[i].key.p && !string_equal(self->slots[i].key, key))
+    i = (i + 1) & (self->cap - 1);
+  return &self->slots[i];
+}
+
+/**
+ * Adds an entry, unless the key is already present, in which case the
+ * earlier entry stays. The table must have room.
+ */
+void hash_table_add(HashTable *self, String key, void *value)
+{
+  HashEntry *entry = hash_table_find(self, key);
+  if (entry->key.p) return;
+  entry->key = key;
+  entry->value = value;
+}
+
+/**
+ * Returns the value for a key, or 0 if there is none.
+ */
+void *hash_table_get(HashTable *self, String key)
+{
+  return hash_table_find(self, key)->value;
+}
+
+#define HASH_PERFECT_TRIES 0x100000
+
+/**
+ * Finds a minimal perfect hash for a set of distinct keys, by hashing and
+ * displacing. Each key lands in bucket hash_seeded(key, 0) % count, and each
+ * bucket gets a seed. If a bucket holds several keys, its seed is positive,
+ * and each key goes in slot hash_seeded(key, seed) % count. If a bucket
+ * holds one key, its seed is -slot - 1, naming the slot directly. Empty
+ * buckets get 0. The largest buckets are placed first, while there is the
+ * most room. Returns 0 if no seeds work, which can only happen if some keys
+ * are the same.
+ */
+int hash_perfect(String const *keys, size_t count, int32_t *seeds, size_t *slots)
+{
+  size_t *bucket = (size_t*)malloc((count + 1)*sizeof(size_t));
+  size_t *start = (size_t*)calloc(count + 2, sizeof(size_t));
+  size_t *members = (size_t*)malloc((count + 1)*sizeof(size_t));
+  size_t *order = (size_t*)malloc((count + 1)*sizeof(size_t));
+  size_t *by_size = (size_t*)calloc(count + 2, sizeof(size_t));
+  size_t *tried = (size_t*)malloc((count + 1)*sizeof(size_t));
+  unsigned char *used = (unsigned char*)calloc(count + 1, 1);
+  size_t i, j, k, b, size, free_slot = 0;
+  uint32_t seed;
+  int rv = 1;
+
+  CHECK_MEMORY(bucket && start && members && order && by_size && tried && used);
+
+  /* Sort the keys by bucket: */
+  for (i = 0; i < count; ++i) {
+    bucket[i] = hash_seeded(keys[i], 0) % count;
+    ++start[bucket[i] + 2];
+  }
+  for (b = 0; b < count; ++b)
+    start[b + 2] += start[b + 1];
+  for (i = 0; i < count; ++i)
+    members[start[bucket[i] + 1]++] = i;
+
+  /* Sort the buckets by size, largest first: */
+  for (b = 0; b < count; ++b)
+    ++by_size[count - (start[b + 1] - start[b])];
+  for (size = 1; size <= count; ++size)
+    by_size[size] += by_size[size - 1];
+  for (b = count; b-- > 0;)
+    order[--by_size[count - (start[b + 1] - start[b])]] = b;
+
+  for (i = 0; rv && i < count; ++i) {
+    b = order[i];
+    size = start[b + 1] - start[b];
+    if (size == 0) {
+      seeds[b] = 0;
+    } else if (size == 1) {
+      while (used[free_slot]) ++free_slot;
+      used[free_slot] = 1;
+      slots[members[start[b]]] = free_slot;
+      seeds[b] = -(int32_t)free_slot - 1;
+    } else {
+      /* Try seeds until every key in the bucket lands in a free slot: */
+      for (seed = 1; seed < HASH_PERFECT_TRIES; ++seed) {
+        for (j = 0; j < size; ++j) {
+          tried[j] = hash_seeded(keys[members[start[b] + j]], seed) % count;
+          if (used[tried[j]]) break;
+          for (k = 0; k < j && tried[k] != tried[j]; ++k) ;
+          if (k < j) break;
+        }
+        if (j == size) break;
+      }
+      if (seed == HASH_PERFECT_TRIES) {
+        rv = 0;
+      } else {
+        for (j = 0; j < size; ++j) {
+          used[tried[j]] = 1;
+          slots[members[start[b] + j]] = tried[j];
+        }
+        seeds[b] = (int32_t)seed;
+      }
+    }
+  }
+
+  free(bucket);
+  free(start);
+  free(members);
+  free(order);
+  free(by_size);
+  free(tried);
+  free(used);
+  return rv;
+}
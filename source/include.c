@@ -0,0 +1,393 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * An include statement parses the included file right in the including
+ * scope, so the file sees everything defined before the include, and its
+ * definitions land next to the includer's own. Since the result depends on
+ * where the include happens, it gets parsed again every time.
+ *
+ * An isolated include is loaded and parsed only once. The file's definitions
+ * go into a scope of their own, which only sees the built-in keywords. That
+ * makes the result independent of where the include happens, so a later
+ * include of the same file just copies the existing definitions into the
+ * including scope. This matters for macro libraries, which are often
+ * included from several files, or from inside macro bodies that get parsed
+ * again on every expansion.
+ *
+ * Files are identified by device and inode number, so different paths to the
+ * same file share one entry. Everything parsed from an included file lives in
+ * a pool belonging to the cache, and a single lock covers the whole include
+ * process, since parsing one file can lead to including others.
+ *
+ * If an up-to-date precompiled library sits next to an isolated include,
+ * its definitions are used instead of parsing the file.
+ *
+ * The cache lasts as long as its context, which matters for the server. Each
+ * entry remembers the modification times of the files it read, along with
+ * the other entries it copied definitions from. The first use in every run
+ * checks all of them, so edits are picked up.
+ */
+
+/**
+ * Uniquely identifies a file on disk.
+ */
+typedef struct {
+#if defined(WIN32)
+  char path[_MAX_PATH];
+#else
+  dev_t dev;
+  ino_t ino;
+#endif
+} FileKey;
+
+/**
+ * An entry in the include cache.
+ */
+typedef struct IncludeUse IncludeUse;
+struct Include {
+  FileKey key;
+  Source *source;
+  Scope *scope;     /* The file's definitions, or 0 while still parsing */
+  Source **files;   /* The files this entry read itself */
+  uint64_t *mtimes; /* The files' modification times when they were read */
+  int file_count;
+  IncludeUse *uses; /* Other entries whose definitions this one copied */
+  int checked;      /* The last run which made sure the files are current */
+  Include *next;
+};
+
+struct IncludeUse {
+  Include *include;
+  IncludeUse *next;
+};
+
+/**
+ * Looks up the identity of a file. Returns 0 if the file does not exist.
+ */
+int file_key(FileKey *key, char const *filename)
+{
+#if defined(WIN32)
+  struct stat st;
+  if (stat(filename, &st)) return 0;
+  return !!_fullpath(key->path, filename, _MAX_PATH);
+#else
+  struct stat st;
+  if (stat(filename, &st)) return 0;
+  key->dev = st.st_dev;
+  key->ino = st.st_ino;
+  return 1;
+#endif
+}
+
+int file_key_equal(FileKey *a, FileKey *b)
+{
+#if defined(WIN32)
+  return !_stricmp(a->path, b->path);
+#else
+  return a->dev == b->dev && a->ino == b->ino;
+#endif
+}
+
+/**
+ * Reports the chain of files leading up to the given one.
+ */
+static void include_print_chain(Source *source)
+{
+  if (!source) return;
+  include_print_chain(source->parent);
+  context_error("%s -> ", source->filename.p);
+}
+
+/**
+ * Reports an include cycle, showing how the files include each other.
+ */
+static int include_cycle(char const *start, Source *parent, String filename)
+{
+  source_location(start);
+  context_error("This file includes itself: ");
+  include_print_chain(parent);
+  context_error("%s\n", filename.p);
+  return 0;
+}
+
+/**
+ * Determines whether a file is the one with the given key. Files from a
+ * library user's resolver are not on disk, so their names must match instead.
+ */
+static int include_same(Context *context, String name, FileKey *key, String filename)
+{
+  FileKey k;
+  if (context->resolve)
+    return string_equal(name, filename);
+  return file_key(&k, name.p) && file_key_equal(&k, key);
+}
+
+/**
+ * Takes ownership of the source files from `from` up to `to`, which are the
+ * ones a cache entry read for itself.
+ */
+static void include_keep(Include *self, Source *from, Source *to)
+{
+  Context *context = context_get();
+  Source *source;
+  struct stat st;
+  int i;
+
+  mutex_lock(&context->source_lock);
+  self->file_count = 0;
+  for (source = from; source != to; source = source->next)
+    ++self->file_count;
+  self->files = (Source**)pool_alloc(&context->include_pool, self->file_count*sizeof(Source*), alignof(Source*));
+  self->mtimes = (uint64_t*)pool_alloc(&context->include_pool, self->file_count*sizeof(uint64_t), alignof(uint64_t));
+  for (source = from, i = 0; source != to; source = source->next, ++i) {
+    source->keep = 1;
+    self->files[i] = source;
+    self->mtimes[i] = context->resolve || stat(source->filename.p, &st) ? 0 : file_mtime(&st);
+  }
+  mutex_unlock(&context->source_lock);
+  self->checked = context->source_run;
+}
+
+/**
+ * Checks that one of the files behind a cache entry has not changed. Files
+ * from a library user's resolver have no modification time, so those get
+ * compared against the resolver's current text.
+ */
+static int include_file_current(Include *self, int i)
+{
+  Context *context = context_get();
+  Source *file = self->files[i];
+  struct stat st;
+
+  if (context->resolve) {
+    char const *text;
+    size_t size;
+    return context->resolve(context->resolve_data, file->filename.p, &text, &size) &&
+      size == (size_t)string_size(file->data) && !memcmp(text, file->data.p, size);
+  }
+  return !stat(file->filename.p, &st) &&
+    (uint64_t)st.st_size == (uint64_t)string_size(file->data) &&
+    file_mtime(&st) == self->mtimes[i];
+}
+
+/**
+ * Checks that none of the files behind a cache entry have changed since
+ * they were read, and marks them as used by the current run. This only
+ * happens once per run, since a long-running server can outlive the files.
+ */
+static int include_current(Include *self)
+{
+  Context *context = context_get();
+  IncludeUse *use;
+  int i;
+
+  if (self->checked == context->source_run) return 1;
+  for (i = 0; i < self->file_count; ++i)
+    if (!include_file_current(self, i))
+      return 0;
+  for (use = self->uses; use; use = use->next)
+    if (!include_current(use->include))
+      return 0;
+
+  mutex_lock(&context->source_lock);
+  for (i = 0; i < self->file_count; ++i)
+    self->files[i]->run = context->source_run;
+  mutex_unlock(&context->source_lock);
+  self->checked = context->source_run;
+  return 1;
+}
+
+/**
+ * Removes an entry from the cache.
+ */
+static void include_remove(Include *self)
+{
+  Include **p;
+  for (p = &context_get()->include_list; *p; p = &(*p)->next)
+    if (*p == self) {
+      *p = self->next;
+      return;
+    }
+}
+
+/**
+ * Copies the definitions from an included file into the including scope.
+ * The symbol list runs newest-first, so the copying goes from the end to
+ * keep later definitions in front. Symbols already visible with the same
+ * value are left alone, so repeated includes don't pile up duplicates.
+ */
+static void include_define(Pool *pool, Scope *scope, Symbol *sym)
+{
+  Dynamic value;
+
+  if (!sym) return;
+  include_define(pool, scope, sym->next);
+
+  if (scope_get(scope, &value, sym->name) &&
+    value.type == sym->value.type && value.p == sym->value.p)
+    return;
+  scope_add(scope, pool, sym->name, sym->value);
+}
+
+/**
+ * Loads an included file and parses it straight into the including scope.
+ */
+static int include_in_place(Pool *pool, Source *parent, char const *start,
+  FileKey *key, String filename, Scope *scope)
+{
+  Context *context = context_get();
+  Source *source, *s;
+  ListBuilder code;
+
+  for (s = parent; s; s = s->parent)
+    if (include_same(context, s->filename, key, filename))
+      return include_cycle(start, parent, filename);
+
+  source = source_load(pool, filename);
+  if (!source)
+    return source_error(start, "Could not open the included file.");
+  source->parent = parent;
+  code = list_builder_init(pool);
+  return parse_code(pool, source, scope, out_list_builder(&code));
+}
+
+/**
+ * Adds an included file's definitions to the given scope. An isolated
+ * include comes from the cache, after loading and parsing the file there if
+ * need be. The `start` parameter points to the include statement's file
+ * name, for error messages.
+ */
+int include_file(Pool *pool, Source *in, char const *start, String filename,
+  Scope *scope, int isolated)
+{
+  Context *context = context_get();
+  FileKey key;
+  Include *self, *outer;
+  Source *parent, *s, *mark;
+  Scope *root;
+  ListBuilder code;
+  int rv = 1;
+
+  memset(&key, 0, sizeof(key));
+  if (!context->resolve && !file_key(&key, filename.p))
+    return source_error(start, "Could not open the included file.");
+  parent = source_find(in->data.p);
+
+  rmutex_lock(&context->include_lock);
+  if (!isolated) {
+    rv = include_in_place(pool, parent, start, &key, filename, scope);
+    goto done;
+  }
+  for (self = context->include_list; self; self = self->next)
+    if (context->resolve ? string_equal(self->source->filename, filename) :
+      file_key_equal(&self->key, &key))
+      break;
+
+  /* Forget entries whose files have changed: */
+  if (self && self->scope && !include_current(self)) {
+    include_remove(self);
+    self = 0;
+  }
+
+  if (!self) {
+    /* Is this file already on the include chain, as the main file? */
+    for (s = parent; s; s = s->parent) {
+      if (include_same(context, s->filename, &key, filename)) {
+        rv = include_cycle(start, parent, filename);
+        goto done;
+      }
+    }
+
+    if (!context->include_pool.block)
+      context->include_pool = pool_init(0x10000);
+    for (root = scope; root->outer; root = root->outer)
+      ;
+    self = pool_new(&context->include_pool, Include);
+    self->key = key;
+    self->uses = 0;
+    mark = context->source_list;
+
+    /* Use a precompiled library, if there is an up-to-date one: */
+    self->scope = context->resolve ? 0 :
+      olc_load(&context->include_pool, filename, root, &self->source);
+    if (self->scope) {
+      self->source->parent = parent;
+      self->next = context->include_list;
+      context->include_list = self;
+      include_keep(self, context->source_list, mark);
+      goto define;
+    }
+
+    self->source = source_load(&context->include_pool, filename);
+    if (!self->source) {
+      rv = source_error(start, "Could not open the included file.");
+      goto done;
+    }
+    self->source->parent = parent;
+    self->next = context->include_list;
+    context->include_list = self;
+
+    /* Parse the file in a scope that only sees the keywords: */
+    code = list_builder_init(&context->include_pool);
+    root = scope_new(&context->include_pool, root);
+    outer = context->include_parsing;
+    context->include_parsing = self;
+    rv = parse_code(&context->include_pool, self->source, root, out_list_builder(&code));
+    context->include_parsing = outer;
+    if (!rv) {
+      include_remove(self);
+      goto done;
+    }
+    self->scope = root;
+
+    /* Keep the file, plus any it included in place: */
+    include_keep(self, context->source_list, mark);
+
+  } else if (!self->scope) {
+    rv = include_cycle(start, parent, filename);
+    goto done;
+  }
+
+define:
+  include_define(pool, scope, self->scope->first);
+
+  /* The file being parsed now depends on this one too: */
+  if (context->include_parsing) {
+    IncludeUse *use = pool_new(&context->include_pool, IncludeUse);
+    use->include = self;
+    use->next = context->include_parsing->uses;
+    context->include_parsing->uses = use;
+  }
+
+done:
+  rmutex_unlock(&context->include_lock);
+  return rv;
+}
+
+/**
+ * Frees everything in the include cache.
+ */
+void include_free(void)
+{
+  Context *context = context_get();
+
+  olc_free();
+  context->include_list = 0;
+  context->include_parsing = 0;
+  if (context->include_pool.block)
+    pool_free(&context->include_pool);
+  context->include_pool.block = 0;
+}
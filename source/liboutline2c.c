@@ -0,0 +1,74 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * The library build, as one big translation unit like the program itself.
+ * This leaves out everything which only the command-line program needs.
+ */
+
+#if !defined(WIN32)
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "outline2c.h"
+
+#include "check.c"
+#include "pool.c"
+#include "thread.c"
+#include "string.c"
+#include "hash.c"
+#include "buffer.c"
+#include "file.c"
+#include "context.c"
+#include "source.c"
+#include "lex.c"
+
+#include "dynamic.c"
+#include "list.c"
+#include "out.c"
+#include "scope.c"
+
+#include "ast.c"
+#include "filter.c"
+#include "parse.c"
+#include "olc.c"
+#include "include.c"
+#include "case.c"
+#include "generate.c"
+
+#include "library.c"
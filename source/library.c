@@ -0,0 +1,190 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * The library functions declared in outline2c.h. Each call makes the
+ * library user's context current for the duration, and arranges for running
+ * out of memory to return an error rather than aborting the whole program.
+ */
+
+struct Outline2cContext {
+  Context context;
+  Pool pool;              /* Holds the keywords */
+  Scope *keywords;
+  Pool run;               /* Memory for the compile in progress */
+  Buffer out;
+  Buffer errors;
+  int broken;             /* Ran out of memory, so only freeing is safe */
+};
+
+static char const library_no_memory[] = "error: Out of memory\n";
+
+/**
+ * Fills in a new context. Running out of memory jumps out of here, so the
+ * caller keeps nothing in local variables that this changes.
+ */
+static void library_context_init(Outline2cContext *self)
+{
+  self->pool = pool_init(0x1000);
+  self->keywords = parse_keywords(&self->pool);
+  self->errors = buffer_init(0x100);
+  *self->errors.p = 0;
+}
+
+Outline2cContext *outline2c_context_new(void)
+{
+  Outline2cContext *volatile self;
+  Context *volatile outer;
+  jmp_buf jump;
+
+  self = (Outline2cContext*)calloc(1, sizeof(Outline2cContext));
+  if (!self) return 0;
+  context_init(&self->context);
+  outer = context_set(&self->context);
+  if (!outer) {
+    context_free(&self->context);
+    free(self);
+    return 0;
+  }
+
+  if (setjmp(jump)) {
+    context_set(outer);
+    pool_free(&self->pool);
+    context_free(&self->context);
+    free(self);
+    return 0;
+  }
+  self->context.out_of_memory = &jump;
+  self->context.owner = thread_self();
+  library_context_init(self);
+
+  self->context.out_of_memory = 0;
+  context_set(outer);
+  return self;
+}
+
+void outline2c_context_free(Outline2cContext *self)
+{
+  Context *outer;
+
+  if (!self) return;
+  outer = context_set(&self->context);
+  include_free();
+  context_set(outer);
+
+  context_free(&self->context);
+  pool_free(&self->pool);
+  buffer_free(&self->errors);
+  free(self);
+}
+
+/**
+ * The library hands back one block of text, so it cannot honor output
+ * statements.
+ */
+static int library_single_output(ListNode *code)
+{
+  for (; code; code = code->next)
+    if (code->d.type == type_output)
+      return source_error(((AstOutput*)code->d.p)->start,
+        "Output statements only work with the outline2c program.");
+  return 1;
+}
+
+/**
+ * Does the work of a compile. Running out of memory jumps out of here, so
+ * the results go into the context rather than the caller's local variables.
+ */
+static int library_compile(Outline2cContext *self, char const *filename,
+  char const *text, size_t size)
+{
+  Source *in;
+  Scope *scope;
+  ListBuilder code;
+  int rv;
+
+  self->run = pool_init(0x10000);
+  self->out = buffer_init(0x10000);
+  in = source_add(&self->run, string_copy(&self->run, string_from_c(filename)),
+    string(text, text + size));
+  scope = scope_new(&self->run, self->keywords);
+  code = list_builder_init(&self->run);
+
+  rv = parse_code(&self->run, in, scope, out_list_builder(&code)) &&
+    library_single_output(code.first) &&
+    generate_code(&self->run, &self->out, code.first) &&
+    buffer_putc(&self->out, 0);
+  buffer_putc(&self->errors, 0);
+  --self->errors.end;
+
+  source_end_run();
+  pool_free(&self->run);
+  return rv;
+}
+
+int outline2c_compile(Outline2cContext *self, char const *filename,
+  char const *text, size_t size, Outline2cResolveFn resolve, void *data,
+  char **output, size_t *output_size)
+{
+  Context *volatile outer;
+  jmp_buf jump;
+  int rv;
+
+  if (self->broken) return 0;
+  outer = context_set(&self->context);
+  if (!outer) return 0;
+  self->errors.end = self->errors.p;
+  self->out.p = 0;
+  self->run.block = 0;
+
+  if (setjmp(jump)) {
+    /* Locks and lists may be half-updated, so give up on the context: */
+    self->broken = 1;
+    self->context.out_of_memory = 0;
+    context_set(outer);
+    free(self->out.p);
+    pool_free(&self->run);
+    return 0;
+  }
+  self->context.out_of_memory = &jump;
+  self->context.owner = thread_self();
+  self->context.resolve = (ContextResolveFn)resolve;
+  self->context.resolve_data = data;
+  self->context.errors = &self->errors;
+
+  rv = library_compile(self, filename, text, size);
+  if (rv) {
+    *output = self->out.p;
+    *output_size = buffer_size(&self->out) - 1;
+  } else {
+    buffer_free(&self->out);
+  }
+
+  self->context.out_of_memory = 0;
+  self->context.resolve = 0;
+  self->context.errors = 0;
+  context_set(outer);
+  return rv;
+}
+
+char const *outline2c_errors(Outline2cContext *self)
+{
+  return self->broken ? library_no_memory : self->errors.p;
+}
+
+void outline2c_free_output(char *output)
+{
+  free(output);
+}
@@ -15,84 +15,343 @@
  */
 
 /**
- * Performs code-generation into the output file given in the options.
+ * Performs code-generation into an output file.
+ *
+ * If the output file already exists, the new text is rendered to memory and
+ * compared with the existing contents. The file is only replaced if they
+ * differ, so build tools do not see a new modification time and rebuild
+ * everything that depends on the file. If the output file does not exist,
+ * there is nothing to compare against, so the text streams straight out to
+ * disk through a background writer. An output file named "-" means standard
+ * output, which also gets the text as it is generated.
  */
-int main_generate(Pool *pool, ListNode *code, Options *opt)
+int main_generate(Pool *pool, ListNode *code, String filename, int jobs)
 {
-  String filename = string_copy(pool, opt->name_out);
-  FILE *file_out = fopen(filename.p, "wb");
-  if (!file_out) {
+  String temp;
+  struct stat st;
+  Writer writer;
+  int fd, rv;
+
+  filename = string_copy(pool, filename);
+
+  /* Standard output: */
+  if (string_equal(filename, string_from_k("-"))) {
+    fflush(stdout);
+#if defined(WIN32)
+    _setmode(1, _O_BINARY);
+#endif
+    writer_init(&writer, 1);
+    rv = generate_parallel(pool, &writer.out, code, jobs);
+    if (!writer_finish(&writer)) {
+      fprintf(stderr, "error: Could not write to standard output\n");
+      rv = 0;
+    }
+    return rv;
+  }
+
+  /* Existing file: */
+  if (!stat(filename.p, &st)) {
+    Buffer out = buffer_init(0x10000);
+    rv = generate_parallel(pool, &out, code, jobs) &&
+      file_update(pool, filename, out.p, out.end);
+    buffer_free(&out);
+    return rv;
+  }
+
+  /* New file: */
+  fd = file_temp(pool, filename, &temp);
+  if (fd < 0) {
     fprintf(stderr, "error: Could not open output file \"%s\"\n", filename.p);
-    return 1;
+    return 0;
   }
 
-  CHECK(generate_code(pool, file_out, code));
+  writer_init(&writer, fd);
+  rv = generate_parallel(pool, &writer.out, code, jobs);
+  if (!writer_finish(&writer) || close(fd)) {
+    fprintf(stderr, "error: Could not write output file \"%s\"\n", filename.p);
+    rv = 0;
+  }
+
+  if (rv && !file_replace(temp.p, filename.p)) {
+    fprintf(stderr, "error: Could not replace output file \"%s\"\n", filename.p);
+    rv = 0;
+  }
+  if (!rv)
+    remove(temp.p);
+  return rv;
+}
+
+/**
+ * Removes the output statements from a list of top-level nodes, leaving the
+ * code for the main output.
+ */
+ListNode *main_code(Pool *pool, ListNode *code)
+{
+  ListBuilder b = list_builder_init(pool);
+  for (; code; code = code->next)
+    if (code->d.type != type_output)
+      list_builder_add(&b, code->d);
+  return b.first;
+}
+
+/**
+ * Generates the files named by output statements. Each one shares the parse
+ * of the input and its includes with the main output, and is named relative
+ * to the main output file.
+ */
+int main_outputs(Pool *pool, ListNode *code, Options *opt)
+{
+  ListNode *node, *other;
+
+  for (node = code; node; node = node->next) {
+    AstOutput *p;
+    String filename, clean;
+    if (node->d.type != type_output) continue;
+    p = node->d.p;
+    filename = source_path(pool, opt->name_out, p->filename);
 
-  fclose(file_out);
+    /* Two outputs with the same name would fight over the file: */
+    clean = source_clean_path(pool, filename);
+    if (string_equal(clean, source_clean_path(pool, opt->name_out)))
+      return source_error(p->start, "This output statement would overwrite the main output.");
+    for (other = code; other != node; other = other->next)
+      if (other->d.type == type_output && string_equal(clean, source_clean_path(pool,
+        source_path(pool, opt->name_out, ((AstOutput*)other->d.p)->filename))))
+        return source_error(p->start, "Another output statement already writes this file.");
+
+    CHECK(main_generate(pool, p->code, filename, opt->jobs));
+  }
   return 1;
 }
 
 /**
- * Program entry point. Constructs and launches the main program object.
+ * Names a shard file by putting its number in front of the output file's
+ * extension, so "foo.c" becomes "foo.0.c", "foo.1.c", and so on.
  */
-int main(int argc, char *argv[])
+String main_shard_name(Pool *pool, String filename, int shard)
+{
+  char const *p, *dot = filename.end;
+  char number[16];
+
+  for (p = filename.p; p < filename.end; ++p) {
+    if (*p == '\\' || *p == '/')
+      dot = filename.end;
+    else if (*p == '.' && p != filename.p && p[-1] != '/' && p[-1] != '\\')
+      dot = p;
+  }
+  sprintf(number, ".%d", shard);
+  return string_cat(pool, string_cat(pool, string(filename.p, dot),
+    string_from_c(number)), string(dot, filename.end));
+}
+
+/**
+ * Generates the main output as a set of shard files, each holding a slice of
+ * every sharded loop along with a copy of the surrounding text. With
+ * --shard, only the one file is written.
+ */
+int main_shards(Pool *pool, ListNode *code, Options *opt)
+{
+  Context *context = context_get();
+  int i, rv = 1;
+
+  context->shards = opt->shards;
+  for (i = 0; rv && i < opt->shards; ++i) {
+    if (0 <= opt->shard && i != opt->shard) continue;
+    context->shard = i;
+    rv = main_generate(pool, code, main_shard_name(pool, opt->name_out, i), opt->jobs);
+  }
+  context->shards = 0;
+  return rv;
+}
+
+/**
+ * Compiles a file as described by the options. Everything the compile
+ * allocates goes in the given pool. The keyword scope outlives the compile,
+ * since the include cache builds on it.
+ */
+int main_compile(Pool *pool, Scope *keywords, Options *opt)
 {
-  Pool pool = pool_init(0x10000); /* 64K block size */
-  Options opt = options_init();
   Source *in;
-  Scope *scope = scope_new(&pool, 0);
-  ListBuilder code = list_builder_init(&pool);
+  Scope *scope = scope_new(pool, keywords);
+  ListBuilder code = list_builder_init(pool);
+  ListNode *rest;
+  Cache cache;
+  SegmentParse segments;
+  uint64_t key = 0;
+  int use_cache = 0, cached = 0;
 
-  /* Read the options: */
-  if (!options_parse(&opt, argc, argv)) {
-    options_usage(argv[0]);
-    goto error;
+  /* Cache statistics: */
+  if (opt->cache_stats) {
+    if (!string_size(opt->cache_dir)) {
+      fprintf(stderr, "error: No cache directory is set.\n");
+      return 0;
+    }
+    if (!cache_init(pool, &cache, opt->cache_dir, opt->cache_size)) return 0;
+    cache_print_stats(&cache);
+    cache_free(&cache);
+    return 1;
   }
 
   /* Determine output file name: */
-  if (!string_size(opt.name_out)) {
-    if (string_rmatch(opt.name_in, string_from_k(".ol")) != 3) {
+  if (!string_size(opt->name_out) && string_equal(opt->name_in, string_from_k("-"))) {
+    fprintf(stderr, "error: When reading standard input, the output file must be given with -o.\n");
+    return 0;
+  } else if (!string_size(opt->name_out) && opt->emit_olc) {
+    opt->name_out = string_cat(pool, opt->name_in, string_from_k("c"));
+  } else if (!string_size(opt->name_out)) {
+    if (string_rmatch(opt->name_in, string_from_k(".ol")) != 3) {
       fprintf(stderr, "error: If no output file is specified, the input file name must end with \".ol\".\n");
-      goto error;
+      return 0;
     }
-    opt.name_out = string(opt.name_in.p, opt.name_in.end - 3);
+    opt->name_out = string(opt->name_in.p, opt->name_in.end - 3);
+  }
+
+  /* Some outputs only make sense as files: */
+  if (string_equal(opt->name_out, string_from_k("-")) &&
+    (opt->emit_olc || opt->incremental || opt->shards)) {
+    fprintf(stderr, "error: The %s option cannot write to standard output.\n",
+      opt->emit_olc ? "--emit-olc" : opt->incremental ? "--incremental" : "--shards");
+    return 0;
+  }
+  if (opt->shards && (opt->emit_olc || opt->incremental)) {
+    fprintf(stderr, "error: The --shards option cannot be combined with %s.\n",
+      opt->emit_olc ? "--emit-olc" : "--incremental");
+    return 0;
   }
 
   /* Input stream: */
-  in = source_load(&pool, opt.name_in);
+  in = source_load(pool, opt->name_in);
   if (!in) {
-    fprintf(stderr, "error: Could not open source file \"%s\"\n", opt.name_in.p);
-    goto error;
+    fprintf(stderr, "error: Could not open source file \"%s\"\n", opt->name_in.p);
+    return 0;
   }
 
-  /* Keywords: */
-  scope_add(scope, &pool, string_from_k("macro"), dynamic(type_keyword,
-    keyword_new(&pool, parse_macro)));
-  scope_add(scope, &pool, string_from_k("outline"), dynamic(type_keyword,
-    keyword_new(&pool, parse_outline)));
-  scope_add(scope, &pool, string_from_k("union"), dynamic(type_keyword,
-    keyword_new(&pool, parse_union)));
-  scope_add(scope, &pool, string_from_k("map"), dynamic(type_keyword,
-    keyword_new(&pool, parse_map)));
-  scope_add(scope, &pool, string_from_k("for"), dynamic(type_keyword,
-    keyword_new(&pool, parse_for)));
-  scope_add(scope, &pool, string_from_k("include"), dynamic(type_keyword,
-    keyword_new(&pool, parse_include)));
+  /* Dependency scan: */
+  if (opt->deps_only) {
+    CHECK(depend_scan(pool, in));
+    return depend_write(pool, opt->name_out,
+      string_size(opt->name_deps) ? opt->name_deps : string_from_k("-"));
+  }
+
+  /* Output cache. The dependency scan loads every file that could affect
+   * the output, so their contents go into the key. Each key holds a single
+   * file, so sharded outputs and inputs with output statements do without: */
+  if (string_size(opt->cache_dir) && !opt->emit_olc && !opt->debug &&
+    !opt->shards && !depend_has_outputs(in)) {
+    if (!cache_init(pool, &cache, opt->cache_dir, opt->cache_size)) goto error;
+    use_cache = 1;
+    if (!depend_scan(pool, in)) goto error;
+    key = cache_key(opt->name_in);
+    cached = cache_fetch(pool, &cache, key, opt->name_out);
+  }
+
+  /* Precompiled library: */
+  if (opt->emit_olc) {
+    if (!parse_code(pool, in, scope, out_list_builder(&code))) goto error;
+    if (!olc_write(pool, opt->name_out, in, scope)) goto error;
+
+  /* Regenerate only the parts that changed: */
+  } else if (!cached && opt->incremental && !opt->debug) {
+    String text;
+    int rv = segment_parse(pool, &segments, in, scope, out_list_builder(&code)) &&
+      segment_generate(pool, &segments, code.first, opt->name_out);
+    segment_free(&segments);
+    if (!rv || !main_outputs(pool, code.first, opt)) goto error;
+    if (use_cache && !(file_read(pool, string_copy(pool, opt->name_out).p, &text) &&
+      cache_store(pool, &cache, key, text.p, text.end)))
+      fprintf(stderr, "warning: Could not add \"%s\" to the output cache\n",
+        string_copy(pool, opt->name_out).p);
 
   /* Do outline2c stuff: */
-  if (!parse_code(&pool, in, scope, out_list_builder(&code))) goto error;
-  if (opt.debug) {
-    printf("--- AST: ---\n");
-    dump_code(code.first, 0);
-    printf("\n");
+  } else if (!cached) {
+    if (!parse_code(pool, in, scope, out_list_builder(&code))) goto error;
+    if (opt->debug) {
+      printf("--- AST: ---\n");
+      dump_code(code.first, 0);
+      printf("\n");
+    }
+    if (!main_outputs(pool, code.first, opt)) goto error;
+    rest = main_code(pool, code.first);
+    if (opt->shards) {
+      if (!main_shards(pool, rest, opt)) goto error;
+
+    } else if (!use_cache) {
+      if (!main_generate(pool, rest, opt->name_out, opt->jobs)) goto error;
+
+    /* The cache needs the text, so render it to memory first: */
+    } else {
+      Buffer out = buffer_init(0x10000);
+      int rv = generate_parallel(pool, &out, rest, opt->jobs) &&
+        file_update(pool, opt->name_out, out.p, out.end);
+
+      /* A cache problem shouldn't fail the build: */
+      if (rv && !cache_store(pool, &cache, key, out.p, out.end))
+        fprintf(stderr, "warning: Could not add \"%s\" to the output cache\n",
+          string_copy(pool, opt->name_out).p);
+      buffer_free(&out);
+      if (!rv) goto error;
+    }
   }
-  if (!main_generate(&pool, code.first, &opt)) goto error;
+  if (opt->deps && !depend_write(pool, opt->name_out,
+    string_size(opt->name_deps) ? opt->name_deps :
+    string_cat(pool, opt->name_out, string_from_k(".d"))))
+    goto error;
 
-  /* Clean up: */
-  pool_free(&pool);
-  return 0;
+  if (use_cache) cache_free(&cache);
+  return 1;
 
 error:
+  if (use_cache) cache_free(&cache);
+  return 0;
+}
+
+/**
+ * Performs one compiler run, as described by a command line, and returns
+ * the exit code.
+ */
+int main_run(Scope *keywords, int argc, char *argv[])
+{
+  Pool pool = pool_init(0x10000); /* 64K block size */
+  Options opt = options_init();
+  int rv = 1;
+
+  if (!options_parse(&opt, &pool, argc, argv) || string_size(opt.server)) {
+    options_usage(argv[0]);
+  } else if (opt.watch) {
+    rv = !watch_run(&pool, keywords, &opt);
+  } else {
+    rv = !main_compile(&pool, keywords, &opt);
+  }
+
+  source_end_run();
   pool_free(&pool);
-  return 1;
+  return rv;
+}
+
+/**
+ * Program entry point. Hands the command line to a compile server if one is
+ * configured and answering, and otherwise does the work here.
+ */
+int main(int argc, char *argv[])
+{
+  Pool pool = pool_init(0x1000);
+  Options opt = options_init();
+  Scope *keywords;
+  int rv;
+
+  if (options_parse(&opt, &pool, argc, argv) && string_size(opt.connect) &&
+    !string_size(opt.server) && !opt.watch && client_run(&pool, opt.connect, argc, argv, &rv)) {
+    pool_free(&pool);
+    return rv;
+  }
+
+  keywords = parse_keywords(&pool);
+  if (string_size(opt.server))
+    rv = !server_run(&pool, opt.server, keywords);
+  else
+    rv = main_run(keywords, argc, argv);
+
+  include_free();
+  pool_free(&pool);
+  return rv;
 }
@@ -0,0 +1,645 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Precompiled outline libraries. An ".olc" file holds the definitions an
+ * ".ol" file produces when it is included, in a form that can be mapped
+ * straight into memory. Every reference inside the file is an offset from
+ * the start of the file, so it works at any address.
+ *
+ * The library's source text travels along inside the ".olc" file. Names,
+ * macro bodies and tag values all point into the mapped image directly, and
+ * error messages from macro bodies still find their original line numbers.
+ * Loading only builds AST nodes for the top-level macros and items. An
+ * outline builds its item and tag nodes from the mapped records the first
+ * time something needs its items, just like the parser leaves outline bodies
+ * alone until then, so an include only pays for the outlines it uses. Macro
+ * bodies and tag values are kept as source text, just like the parser keeps
+ * them.
+ *
+ * Each source file that went into the library is recorded with its size and
+ * modification time. If any of them change, the library is out of date and
+ * the include falls back on parsing the ".ol" file.
+ */
+
+#define OLC_MAGIC "OLC1"
+#define OLC_VERSION 1
+#define OLC_ENDIAN 0x01020304
+
+/**
+ * A string stored somewhere in the file. An offset of 0 means no string.
+ */
+typedef struct {
+  uint32_t offset;
+  uint32_t size;
+} OlcString;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t endian;        /* Catches byte-order mismatches */
+  uint32_t size;          /* The size of the whole file */
+  uint32_t file_count;
+  uint32_t files;         /* Offset of an OlcFile array */
+  uint32_t symbol_count;
+  uint32_t symbols;       /* Offset of an OlcSymbol array, oldest first */
+} OlcHeader;
+
+/**
+ * A source file which went into the library.
+ */
+typedef struct {
+  OlcString name;         /* Relative to the library's own directory */
+  OlcString text;
+  uint64_t size;
+  uint64_t mtime;         /* In nanoseconds, where the platform has them */
+} OlcFile;
+
+typedef struct {
+  OlcString name;
+  uint32_t type;          /* The symbol's Type */
+  uint32_t value;         /* Offset of an OlcOutline, OlcItem or OlcMacro */
+} OlcSymbol;
+
+typedef struct {
+  uint32_t item_count;
+  uint32_t items;         /* Offset of an array of OlcItem offsets */
+} OlcOutline;
+
+typedef struct {
+  OlcString name;
+  uint32_t tag_count;
+  uint32_t tags;          /* Offset of an OlcTag array */
+  uint32_t children;      /* Offset of an OlcOutline, or 0 */
+} OlcItem;
+
+typedef struct {
+  OlcString name;
+  OlcString value;        /* Points into the source text */
+} OlcTag;
+
+typedef struct {
+  uint32_t input_count;
+  uint32_t inputs;        /* Offset of an OlcString array */
+  OlcString code;         /* Points into the source text */
+} OlcMacro;
+
+/*
+ * Writing -----------------------------------------------------------------
+ */
+
+typedef struct {
+  Pool *pool;
+  Buffer out;
+  Source **sources;       /* The source files being stored */
+  uint32_t *texts;        /* Where each file's text went */
+  int source_count;
+} OlcWriter;
+
+/**
+ * Appends a record, aligned to 8 bytes, and returns its offset.
+ */
+static uint32_t olc_put(OlcWriter *w, void const *p, size_t size)
+{
+  static char const zero[8] = {0};
+  size_t offset = buffer_size(&w->out);
+  size_t pad = (8 - offset % 8) % 8;
+
+  buffer_write(&w->out, zero, zero + pad);
+  buffer_write(&w->out, (char const*)p, (char const*)p + size);
+  return (uint32_t)(offset + pad);
+}
+
+/**
+ * Appends a null-terminated copy of a string.
+ */
+static OlcString olc_put_string(OlcWriter *w, String s)
+{
+  OlcString out;
+  out.offset = (uint32_t)buffer_size(&w->out);
+  out.size = (uint32_t)string_size(s);
+  buffer_write(&w->out, s.p, s.end);
+  buffer_putc(&w->out, 0);
+  return out;
+}
+
+/**
+ * Finds a piece of source code within the stored source files.
+ */
+static int olc_ref(OlcWriter *w, String s, OlcString *out)
+{
+  int i;
+  for (i = 0; i < w->source_count; ++i) {
+    Source *source = w->sources[i];
+    if (source->data.p <= s.p && s.end <= source->data.end) {
+      out->offset = w->texts[i] + (uint32_t)(s.p - source->data.p);
+      out->size = (uint32_t)string_size(s);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static uint32_t olc_put_outline(OlcWriter *w, AstOutline *outline);
+
+static uint32_t olc_put_item(OlcWriter *w, AstOutlineItem *item)
+{
+  OlcItem r;
+  OlcTag *tags;
+  ListNode *node;
+  int i;
+
+  r.tag_count = list_length(item->tags);
+  tags = (OlcTag*)pool_alloc(w->pool, (r.tag_count + 1)*sizeof(OlcTag), alignof(OlcTag));
+  for (node = item->tags, i = 0; node; node = node->next, ++i) {
+    AstOutlineTag *tag = ast_to_outline_tag(node->d);
+    tags[i].name = olc_put_string(w, tag->name);
+    tags[i].value.offset = 0;
+    tags[i].value.size = 0;
+    if (tag->text.p && !olc_ref(w, tag->text, &tags[i].value))
+      return 0;
+  }
+  r.tags = r.tag_count ? olc_put(w, tags, r.tag_count*sizeof(OlcTag)) : 0;
+
+  r.children = 0;
+  if (item->children) {
+    r.children = olc_put_outline(w, item->children);
+    if (!r.children) return 0;
+  }
+
+  r.name = olc_put_string(w, item->name);
+  return olc_put(w, &r, sizeof(r));
+}
+
+static uint32_t olc_put_outline(OlcWriter *w, AstOutline *outline)
+{
+  OlcOutline r;
+  uint32_t *items;
+  ListNode *node;
+  int i;
+
+  if (!parse_outline_body(outline)) return 0;
+  r.item_count = list_length(outline->items);
+  items = (uint32_t*)pool_alloc(w->pool, (r.item_count + 1)*sizeof(uint32_t), alignof(uint32_t));
+  for (node = outline->items, i = 0; node; node = node->next, ++i) {
+    items[i] = olc_put_item(w, ast_to_outline_item(node->d));
+    if (!items[i]) return 0;
+  }
+  r.items = olc_put(w, items, r.item_count*sizeof(uint32_t));
+  return olc_put(w, &r, sizeof(r));
+}
+
+static uint32_t olc_put_macro(OlcWriter *w, AstMacro *macro)
+{
+  OlcMacro r;
+  OlcString *inputs;
+  ListNode *node;
+  int i;
+
+  r.input_count = list_length(macro->inputs);
+  inputs = (OlcString*)pool_alloc(w->pool, (r.input_count + 1)*sizeof(OlcString), alignof(OlcString));
+  for (node = macro->inputs, i = 0; node; node = node->next, ++i)
+    inputs[i] = olc_put_string(w, ((AstCodeText*)node->d.p)->code);
+  r.inputs = olc_put(w, inputs, r.input_count*sizeof(OlcString));
+
+  if (!olc_ref(w, string(macro->code.cursor, macro->code.data.end), &r.code))
+    return 0;
+  return olc_put(w, &r, sizeof(r));
+}
+
+/**
+ * Writes the definitions in a scope to a precompiled library file. The
+ * library's directory is taken from the `in` source file.
+ */
+int olc_write(Pool *pool, String filename, Source *in, Scope *scope)
+{
+  Context *context = context_get();
+  OlcWriter w;
+  OlcHeader header;
+  OlcFile *files;
+  OlcSymbol *symbols;
+  Symbol *sym;
+  Source *source;
+  String dir = source_path(pool, in->filename, string_from_k(""));
+  int i, n;
+
+  w.pool = pool;
+  w.out = buffer_init(0x10000);
+
+  /* Leave room for the header: */
+  memset(&header, 0, sizeof(header));
+  olc_put(&w, &header, sizeof(header));
+
+  /* Source files, oldest first: */
+  mutex_lock(&context->source_lock);
+  w.source_count = 0;
+  for (source = context->source_list; source; source = source->next)
+    if (source->run == context->source_run) ++w.source_count;
+  w.sources = (Source**)pool_alloc(pool, w.source_count*sizeof(Source*), alignof(Source*));
+  for (source = context->source_list, i = w.source_count; source; source = source->next)
+    if (source->run == context->source_run) w.sources[--i] = source;
+  mutex_unlock(&context->source_lock);
+
+  w.texts = (uint32_t*)pool_alloc(pool, w.source_count*sizeof(uint32_t), alignof(uint32_t));
+  files = (OlcFile*)pool_alloc(pool, w.source_count*sizeof(OlcFile), alignof(OlcFile));
+  for (i = 0; i < w.source_count; ++i) {
+    String name = w.sources[i]->filename;
+    struct stat st;
+
+    if (stat(name.p, &st)) {
+      fprintf(stderr, "error: Could not find source file \"%s\"\n", name.p);
+      goto error;
+    }
+    files[i].size = st.st_size;
+    files[i].mtime = file_mtime(&st);
+    if (string_match(name, dir) == (size_t)string_size(dir))
+      name.p += string_size(dir);
+    files[i].name = olc_put_string(&w, name);
+    files[i].text = olc_put_string(&w, w.sources[i]->data);
+    w.texts[i] = files[i].text.offset;
+  }
+  header.file_count = w.source_count;
+  header.files = olc_put(&w, files, w.source_count*sizeof(OlcFile));
+
+  /* Symbols, oldest first: */
+  n = 0;
+  for (sym = scope->first; sym; sym = sym->next)
+    ++n;
+  symbols = (OlcSymbol*)pool_alloc(pool, (n + 1)*sizeof(OlcSymbol), alignof(OlcSymbol));
+  for (sym = scope->first, i = n; sym; sym = sym->next) {
+    OlcSymbol *r = &symbols[--i];
+    r->name = olc_put_string(&w, sym->name);
+    r->type = sym->value.type;
+    if (sym->value.type == type_outline)
+      r->value = olc_put_outline(&w, sym->value.p);
+    else if (sym->value.type == type_outline_item)
+      r->value = olc_put_item(&w, sym->value.p);
+    else if (sym->value.type == type_macro)
+      r->value = olc_put_macro(&w, sym->value.p);
+    else
+      r->value = 0;
+    if (!r->value) {
+      fprintf(stderr, "error: Cannot precompile the definition of \"%s\".\n",
+        string_copy(pool, sym->name).p);
+      goto error;
+    }
+  }
+  header.symbol_count = n;
+  header.symbols = olc_put(&w, symbols, n*sizeof(OlcSymbol));
+
+  /* Fill in the header: */
+  if (0xffffffffUL < buffer_size(&w.out)) {
+    fprintf(stderr, "error: The precompiled library is too large.\n");
+    goto error;
+  }
+  memcpy(header.magic, OLC_MAGIC, 4);
+  header.version = OLC_VERSION;
+  header.endian = OLC_ENDIAN;
+  header.size = (uint32_t)buffer_size(&w.out);
+  memcpy(w.out.p, &header, sizeof(header));
+
+  /* Write the file: */
+  if (!file_write(pool, filename, w.out.p, w.out.end))
+    goto error;
+
+  buffer_free(&w.out);
+  return 1;
+
+error:
+  buffer_free(&w.out);
+  return 0;
+}
+
+/*
+ * Reading -----------------------------------------------------------------
+ */
+
+/**
+ * A mapped library file. These stay around until olc_free.
+ */
+struct OlcMap {
+  char *p;
+  size_t size;
+  OlcMap *next;
+};
+
+typedef struct {
+  Pool *pool;
+  String filename;  /* For error messages */
+  char const *base;
+  uint32_t size;
+  Scope *scope;
+} OlcReader;
+
+/**
+ * An outline whose items are still in the mapped file.
+ */
+typedef struct {
+  OlcReader *r;
+  uint32_t offset;
+  Scope *scope;           /* The definitions its tag values can see */
+} OlcLazy;
+
+/* Checks that a range of bytes lies within the file: */
+#define OLC_VALID(r, offset, length) \
+  ((offset) <= (r)->size && (length) <= (r)->size - (offset))
+
+static int olc_string(OlcReader *r, OlcString s, String *out)
+{
+  if (!OLC_VALID(r, s.offset, s.size)) return 0;
+  *out = string(r->base + s.offset, r->base + s.offset + s.size);
+  return 1;
+}
+
+/**
+ * Finds a record in the file, checking that it fits.
+ */
+static void const *olc_record(OlcReader *r, uint32_t offset, size_t size, uint32_t count)
+{
+  if (!offset || offset % 8) return 0;
+  if (count && (r->size / size) < count) return 0;
+  if (!OLC_VALID(r, offset, size*count)) return 0;
+  return r->base + offset;
+}
+
+static AstOutline *olc_outline(OlcReader *r, uint32_t offset, Scope *scope);
+
+static AstOutlineItem *olc_item(OlcReader *r, uint32_t offset, Scope *scope)
+{
+  OlcItem const *item = olc_record(r, offset, sizeof(OlcItem), 1);
+  OlcTag const *tags;
+  AstOutlineItem *self = pool_new(r->pool, AstOutlineItem);
+  ListBuilder b = list_builder_init(r->pool);
+  uint32_t i;
+
+  if (!item) return 0;
+  tags = olc_record(r, item->tags, sizeof(OlcTag), item->tag_count);
+  if (item->tag_count && !tags) return 0;
+  if (!olc_string(r, item->name, &self->name)) return 0;
+
+  for (i = 0; i < item->tag_count; ++i) {
+    String name, text = string_null();
+    if (!olc_string(r, tags[i].name, &name)) return 0;
+
+    /* Tag values are parsed from their source text when first used: */
+    if (tags[i].value.offset) {
+      if (!olc_string(r, tags[i].value, &text)) return 0;
+      if (!source_find(text.p)) return 0;
+    }
+    list_builder_add(&b, dynamic(type_outline_tag,
+      ast_outline_tag_new(r->pool, name, text, scope)));
+  }
+  self->tags = b.first;
+
+  self->children = 0;
+  if (item->children) {
+    self->children = olc_outline(r, item->children, scope);
+    if (!self->children) return 0;
+  }
+  return self;
+}
+
+/**
+ * Builds a precompiled outline's items, the first time they are needed.
+ */
+static int olc_outline_load(AstOutline *self, void *data)
+{
+  OlcLazy *lazy = data;
+  OlcReader *r = lazy->r;
+  OlcOutline const *outline = olc_record(r, lazy->offset, sizeof(OlcOutline), 1);
+  uint32_t const *items = olc_record(r, outline->items, sizeof(uint32_t), outline->item_count);
+  ListBuilder b = list_builder_init(r->pool);
+  uint32_t i;
+
+  for (i = 0; i < outline->item_count; ++i) {
+    AstOutlineItem *item = olc_item(r, items[i], lazy->scope);
+    if (!item) {
+      context_error("error: The precompiled library \"%sc\" is damaged.\n",
+        r->filename.p);
+      return 0;
+    }
+    list_builder_add(&b, dynamic(type_outline_item, item));
+  }
+  self->items = b.first;
+  self->parsed = 1;
+  return 1;
+}
+
+/**
+ * Makes an outline which builds its items from the file later on. Only the
+ * outline record itself gets checked now.
+ */
+static AstOutline *olc_outline(OlcReader *r, uint32_t offset, Scope *scope)
+{
+  OlcOutline const *outline = olc_record(r, offset, sizeof(OlcOutline), 1);
+  AstOutline *self;
+  AstOutlineLoad *load;
+  OlcLazy *lazy;
+
+  if (!outline) return 0;
+  if (!olc_record(r, outline->items, sizeof(uint32_t), outline->item_count))
+    return 0;
+
+  lazy = pool_new(r->pool, OlcLazy);
+  lazy->r = r;
+  lazy->offset = offset;
+  lazy->scope = scope;
+  load = pool_new(r->pool, AstOutlineLoad);
+  load->load = olc_outline_load;
+  load->data = lazy;
+  self = ast_outline_new(r->pool, 0);
+  self->source = dynamic(type_outline_load, load);
+  self->parsed = 0;
+  return self;
+}
+
+static AstMacro *olc_macro(OlcReader *r, uint32_t offset)
+{
+  OlcMacro const *macro = olc_record(r, offset, sizeof(OlcMacro), 1);
+  OlcString const *inputs;
+  AstMacro *self = pool_new(r->pool, AstMacro);
+  ListBuilder b = list_builder_init(r->pool);
+  Source *source;
+  String code;
+  uint32_t i;
+
+  if (!macro) return 0;
+  inputs = olc_record(r, macro->inputs, sizeof(OlcString), macro->input_count);
+  if (!inputs) return 0;
+
+  for (i = 0; i < macro->input_count; ++i) {
+    AstCodeText *input = pool_new(r->pool, AstCodeText);
+    if (!olc_string(r, inputs[i], &input->code)) return 0;
+    list_builder_add(&b, dynamic(type_code_text, input));
+  }
+  self->inputs = b.first;
+  self->scope = r->scope;
+
+  if (!olc_string(r, macro->code, &code)) return 0;
+  source = source_find(code.p);
+  if (!source) return 0;
+  self->code = *source;
+  self->code.cursor = code.p;
+  self->code.data.end = code.end;
+  return self;
+}
+
+/**
+ * Maps a file into memory. Returns 0 if the file does not exist.
+ */
+static OlcMap *olc_map(Pool *pool, char const *filename)
+{
+  OlcMap *self;
+  struct stat st;
+#if defined(WIN32)
+  FILE *file;
+
+  if (stat(filename, &st) || !st.st_size) return 0;
+  file = fopen(filename, "rb");
+  if (!file) return 0;
+  self = pool_new(pool, OlcMap);
+  self->size = st.st_size;
+  self->p = (char*)pool_alloc(pool, self->size, 8);
+  if (fread(self->p, 1, self->size, file) != self->size) {
+    fclose(file);
+    return 0;
+  }
+  fclose(file);
+#else
+  void *p;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    return 0;
+  }
+  p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return 0;
+
+  self = pool_new(pool, OlcMap);
+  self->p = (char*)p;
+  self->size = st.st_size;
+#endif
+  self->next = context_get()->olc_maps;
+  context_get()->olc_maps = self;
+  return self;
+}
+
+/**
+ * Loads the precompiled library for an ".ol" file, if there is an up-to-date
+ * one sitting next to it. The library's definitions go into a new scope
+ * inside `root`, which is returned, and the library's own source file goes
+ * into `*source`. Returns 0 if there is no usable library, and leaves no
+ * source files behind in that case.
+ */
+Scope *olc_load(Pool *pool, String filename, Scope *root, Source **source)
+{
+  OlcMap *map;
+  OlcReader *r;
+  OlcHeader const *header;
+  OlcFile const *files;
+  OlcSymbol const *symbols;
+  String *names;
+  Source **added;
+  uint32_t added_count = 0;
+  uint32_t i;
+
+  map = olc_map(pool, string_cat(pool, filename, string_from_k("c")).p);
+  if (!map) return 0;
+  r = pool_new(pool, OlcReader);
+  r->pool = pool;
+  r->filename = filename;
+  r->base = map->p;
+  r->size = map->size < 0xffffffffUL ? (uint32_t)map->size : 0xffffffffUL;
+  r->scope = 0;
+
+  /* Header: */
+  header = (OlcHeader const*)r->base;
+  if (r->size < sizeof(OlcHeader) ||
+    memcmp(header->magic, OLC_MAGIC, 4) ||
+    header->version != OLC_VERSION ||
+    header->endian != OLC_ENDIAN ||
+    header->size != map->size ||
+    !header->file_count)
+    return 0;
+
+  /* Are all the source files unchanged? */
+  files = olc_record(r, header->files, sizeof(OlcFile), header->file_count);
+  if (!files) return 0;
+  names = (String*)pool_alloc(pool, header->file_count*sizeof(String), alignof(String));
+  for (i = 0; i < header->file_count; ++i) {
+    struct stat st;
+    String name;
+    if (!olc_string(r, files[i].name, &name)) return 0;
+    names[i] = source_path(pool, filename, name);
+    if (stat(names[i].p, &st) ||
+      (uint64_t)st.st_size != files[i].size ||
+      file_mtime(&st) != files[i].mtime)
+      return 0;
+  }
+
+  /* Make the source text available for error messages: */
+  added = (Source**)pool_alloc(pool, header->file_count*sizeof(Source*), alignof(Source*));
+  for (i = 0; i < header->file_count; ++i) {
+    String text;
+    if (!olc_string(r, files[i].text, &text)) goto fail;
+    added[added_count++] = source_add(pool, names[i], text);
+  }
+
+  /* Definitions: */
+  r->scope = scope_new(pool, root);
+  symbols = olc_record(r, header->symbols, sizeof(OlcSymbol), header->symbol_count);
+  if (header->symbol_count && !symbols) goto fail;
+  for (i = 0; i < header->symbol_count; ++i) {
+    String name;
+    Dynamic value = dynamic_none();
+    /* Like the parser, only earlier definitions are visible: */
+    Scope *seen = scope_snapshot(pool, r->scope);
+    if (!olc_string(r, symbols[i].name, &name)) goto fail;
+    if (symbols[i].type == type_outline)
+      value = dynamic(type_outline, olc_outline(r, symbols[i].value, seen));
+    else if (symbols[i].type == type_outline_item)
+      value = dynamic(type_outline_item, olc_item(r, symbols[i].value, seen));
+    else if (symbols[i].type == type_macro)
+      value = dynamic(type_macro, olc_macro(r, symbols[i].value));
+    if (!value.p) goto fail;
+    scope_add(r->scope, pool, name, value);
+  }
+
+  /* The main file always comes first: */
+  *source = added[0];
+  return r->scope;
+
+fail:
+  /* Nothing depends on this library's files after all: */
+  for (i = 0; i < added_count; ++i)
+    source_remove(added[i]);
+  return 0;
+}
+
+/**
+ * Unmaps all the library files.
+ */
+void olc_free(void)
+{
+  Context *context = context_get();
+#if !defined(WIN32)
+  OlcMap *map;
+  for (map = context->olc_maps; map; map = map->next)
+    munmap(map->p, map->size);
+#endif
+  context->olc_maps = 0;
+}
@@ -19,26 +19,151 @@
  */
 typedef struct {
   unsigned debug: 1;
+  unsigned deps: 1;       /* Write a dependency file */
+  unsigned deps_only: 1;  /* Only write dependencies, without generating */
+  unsigned emit_olc: 1;   /* Write a precompiled library instead of code */
+  unsigned cache_stats: 1;  /* Print the output cache counters */
+  unsigned watch: 1;      /* Regenerate whenever an input changes */
+  unsigned incremental: 1;  /* Reuse unchanged parts of the old output */
+  int jobs;
+  int shards;             /* Split the output into this many files */
+  int shard;              /* The only shard to write, or -1 for all */
+  uint64_t cache_size;
+  String *inputs;         /* All the input files, for watch mode */
+  int input_count;
   String name_in;
   String name_out;
+  String name_deps;
+  String cache_dir;
+  String server;          /* Run as a compile server on this socket */
+  String connect;         /* Forward the work to the server on this socket */
 } Options;
 
+/**
+ * Reads a size in bytes, with an optional K, M or G suffix.
+ */
+static int options_parse_size(uint64_t *size, String s)
+{
+  char const *p;
+  uint64_t n = 0;
+
+  if (!string_size(s)) return 0;
+  for (p = s.p; p < s.end && '0' <= *p && *p <= '9'; ++p)
+    n = 10*n + (*p - '0');
+  if (p == s.p) return 0;
+
+  if (p < s.end) {
+    if (*p == 'k' || *p == 'K') n <<= 10;
+    else if (*p == 'm' || *p == 'M') n <<= 20;
+    else if (*p == 'g' || *p == 'G') n <<= 30;
+    else return 0;
+    ++p;
+  }
+  if (p != s.end) return 0;
+
+  *size = n;
+  return 1;
+}
+
+/**
+ * Sets up the default options. The output cache and compile server settings
+ * come from the environment, so a whole build can use them without touching
+ * every command line.
+ */
 Options options_init()
 {
   Options self;
+  char const *env;
   self.debug = 0;
+  self.deps = 0;
+  self.deps_only = 0;
+  self.emit_olc = 0;
+  self.cache_stats = 0;
+  self.watch = 0;
+  self.incremental = 0;
+  self.jobs = 1;
+  self.shards = 0;
+  self.shard = -1;
+  self.inputs = 0;
+  self.input_count = 0;
   self.name_in = string_null();
   self.name_out = string_null();
+  self.name_deps = string_null();
+
+  self.cache_dir = string_null();
+  env = getenv("OUTLINE2C_CACHE_DIR");
+  if (env && *env) self.cache_dir = string_from_c(env);
+  self.cache_size = (uint64_t)256 << 20;
+  env = getenv("OUTLINE2C_CACHE_SIZE");
+  if (env) options_parse_size(&self.cache_size, string_from_c(env));
+
+  self.server = string_null();
+  self.connect = string_null();
+  env = getenv("OUTLINE2C_SERVER");
+  if (env && *env) self.connect = string_from_c(env);
   return self;
 }
 
+/**
+ * Reads the thread count given to the -j option. Zero means one thread per
+ * processor.
+ */
+static int options_parse_jobs(Options *self, String s)
+{
+  char const *p;
+  int jobs = 0;
+
+  if (!string_size(s)) return 0;
+  for (p = s.p; p < s.end; ++p) {
+    if (*p < '0' || '9' < *p) return 0;
+    jobs = 10*jobs + (*p - '0');
+    if (1000 < jobs) return 0;
+  }
+
+  self->jobs = jobs ? jobs : thread_count();
+  return 1;
+}
+
+/**
+ * Reads a number from the start of a string, advancing past it.
+ */
+static int options_parse_int(String *s, int *n)
+{
+  char const *p;
+
+  *n = 0;
+  for (p = s->p; p < s->end && '0' <= *p && *p <= '9'; ++p) {
+    *n = 10*(*n) + (*p - '0');
+    if (100000 < *n) return 0;
+  }
+  if (p == s->p) return 0;
+  s->p = p;
+  return 1;
+}
+
+/**
+ * Reads the argument to --shards, which is a count, or to --shard, which is
+ * an index and a count separated by a slash.
+ */
+static int options_parse_shard(Options *self, String s, int pick)
+{
+  if (pick) {
+    if (!options_parse_int(&s, &self->shard)) return 0;
+    if (s.p == s.end || *s.p++ != '/') return 0;
+  }
+  if (!options_parse_int(&s, &self->shards) || s.p != s.end) return 0;
+  return 0 < self->shards && self->shard < self->shards;
+}
+
 /**
  * Processes the command-line options, filling in the members of the Options
  * structure corresponding to the switches
  */
-int options_parse(Options *self, int argc, char *argv[])
+int options_parse(Options *self, Pool *pool, int argc, char *argv[])
 {
-  int arg = 1;
+  int arg = 1, i;
+
+  self->inputs = (String*)pool_alloc(pool, argc*sizeof(String), alignof(String));
 
   while (arg < argc) {
     String s = string_from_c(argv[arg]);
@@ -47,6 +172,81 @@ int options_parse(Options *self, int argc, char *argv[])
     if (!strcmp(argv[arg], "-d") || !strcmp(argv[arg], "--debug")) {
       self->debug = 1;
 
+    /* Number of generator threads: */
+    } else if (!strcmp(argv[arg], "-j") || !strcmp(argv[arg], "--jobs")) {
+      ++arg;
+      if (argc <= arg) return 0;
+      if (!options_parse_jobs(self, string_from_c(argv[arg]))) return 0;
+
+    /* Number of generator threads, smushed: */
+    } else if (2 == string_match(s, string_from_k("-j"))) {
+      if (!options_parse_jobs(self, string(s.p + 2, s.end))) return 0;
+
+    /* Dependencies only: */
+    } else if (!strcmp(argv[arg], "-M")) {
+      self->deps_only = 1;
+
+    /* Dependencies as a side effect: */
+    } else if (!strcmp(argv[arg], "-MD")) {
+      self->deps = 1;
+
+    /* Dependency filename: */
+    } else if (!strcmp(argv[arg], "-MF")) {
+      ++arg;
+      if (argc <= arg) return 0;
+      self->deps = 1;
+      self->name_deps = string_from_c(argv[arg]);
+
+    /* Dependency filename, smushed: */
+    } else if (3 == string_match(s, string_from_k("-MF"))) {
+      self->deps = 1;
+      self->name_deps = string(s.p + 3, s.end);
+
+    /* Precompiled library: */
+    } else if (!strcmp(argv[arg], "--emit-olc")) {
+      self->emit_olc = 1;
+
+    /* Incremental regeneration: */
+    } else if (!strcmp(argv[arg], "--incremental")) {
+      self->incremental = 1;
+
+    /* Output sharding: */
+    } else if (!strcmp(argv[arg], "--shards")) {
+      ++arg;
+      if (argc <= arg) return 0;
+      self->shard = -1;
+      if (!options_parse_shard(self, string_from_c(argv[arg]), 0)) return 0;
+
+    } else if (!strcmp(argv[arg], "--shard")) {
+      ++arg;
+      if (argc <= arg) return 0;
+      if (!options_parse_shard(self, string_from_c(argv[arg]), 1)) return 0;
+
+    /* Output cache: */
+    } else if (!strcmp(argv[arg], "--cache-dir")) {
+      ++arg;
+      if (argc <= arg) return 0;
+      self->cache_dir = string_from_c(argv[arg]);
+
+    } else if (!strcmp(argv[arg], "--cache-size")) {
+      ++arg;
+      if (argc <= arg) return 0;
+      if (!options_parse_size(&self->cache_size, string_from_c(argv[arg]))) return 0;
+
+    } else if (!strcmp(argv[arg], "--cache-stats")) {
+      self->cache_stats = 1;
+
+    /* Compile server: */
+    } else if (!strcmp(argv[arg], "--server")) {
+      ++arg;
+      if (argc <= arg) return 0;
+      self->server = string_from_c(argv[arg]);
+
+    } else if (!strcmp(argv[arg], "--connect")) {
+      ++arg;
+      if (argc <= arg) return 0;
+      self->connect = string_from_c(argv[arg]);
+
     /* Output filename: */
     } else if (!strcmp(argv[arg], "-o")) {
       ++arg;
@@ -57,15 +257,29 @@ int options_parse(Options *self, int argc, char *argv[])
     } else if (2 == string_match(s, string_from_k("-o"))) {
       self->name_out = string(s.p + 2, s.end);
 
+    /* Watch mode: */
+    } else if (!strcmp(argv[arg], "--watch")) {
+      self->watch = 1;
+
     /* Input filename: */
     } else {
-      if (string_size(self->name_in)) return 0;
-      self->name_in = s;
+      self->inputs[self->input_count++] = s;
+      self->name_in = self->inputs[0];
     }
     ++arg;
   }
 
-  if (!string_size(self->name_in))
+  /* Only watch mode can handle several inputs, each with its own output: */
+  if (1 < self->input_count && (!self->watch || string_size(self->name_out)))
+    return 0;
+
+  /* There is no watching standard input for changes: */
+  for (i = 0; self->watch && i < self->input_count; ++i)
+    if (string_equal(self->inputs[i], string_from_k("-")))
+      return 0;
+
+  if (!string_size(self->name_in) && !self->cache_stats &&
+    !string_size(self->server))
     return 0;
 
   return 1;
@@ -76,5 +290,10 @@ int options_parse(Options *self, int argc, char *argv[])
  */
 void options_usage(char *name)
 {
-  fprintf(stderr, "Usage: %s [-d] [-o output-file] <input-file>\n", name);
+  fprintf(stderr, "Usage: %s [-d] [-j jobs] [-M] [-MD] [-MF deps-file] [--emit-olc]\n"
+    "  [--incremental] [--shards n] [--shard i/n] [--cache-dir dir]\n"
+    "  [--cache-size size] [--connect socket] [-o output-file] <input-file>\n"
+    "       %s --watch [options] <input-file>...\n"
+    "       %s [--cache-dir dir] --cache-stats\n"
+    "       %s --server socket\n", name, name, name, name);
 }
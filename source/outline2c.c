@@ -14,29 +14,81 @@
  * limitations under the License.
  */
 
+#if !defined(WIN32)
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#endif
+/* For checking who is on the other end of the compile server's socket: */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#elif defined(__APPLE__)
+#define _DARWIN_C_SOURCE
+#endif
+
 #include <assert.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
 
 #include "check.c"
 #include "pool.c"
+#include "thread.c"
 #include "string.c"
+#include "hash.c"
+#include "buffer.c"
+#include "file.c"
+#include "context.c"
 #include "source.c"
 #include "lex.c"
 
 #include "dynamic.c"
 #include "list.c"
 #include "out.c"
+#include "writer.c"
 #include "scope.c"
 
 #include "ast.c"
 #include "filter.c"
 #include "parse.c"
+#include "olc.c"
+#include "include.c"
 #include "dump.c"
 #include "case.c"
 #include "generate.c"
+#include "parallel.c"
+#include "depend.c"
+#include "cache.c"
+#include "segment.c"
 
 #include "options.c"
+#include "server.c"
+#include "watch.c"
 #include "main.c"
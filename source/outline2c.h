@@ -0,0 +1,83 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * The outline2c library, for running the compiler inside another program.
+ *
+ * Each context holds its own include cache, so a program compiling many files
+ * should keep a context around rather than making a new one each time. A
+ * context may only be used by one thread at a time, but separate contexts
+ * share nothing, so different threads can compile in different contexts at
+ * once.
+ */
+#ifndef OUTLINE2C_H
+#define OUTLINE2C_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The library build hides everything else, so only these names get out: */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define OUTLINE2C_API __attribute__((visibility("default")))
+#else
+#define OUTLINE2C_API
+#endif
+
+typedef struct Outline2cContext Outline2cContext;
+
+/**
+ * Supplies the text of an included file. The file name has already been
+ * resolved against the name of the including file. Returns 0 if there is no
+ * such file. The text only needs to stay valid until the next call.
+ */
+typedef int (*Outline2cResolveFn)(void *data, char const *filename,
+  char const **text, size_t *size);
+
+/**
+ * Creates a compiler context. Returns 0 if there is not enough memory.
+ */
+OUTLINE2C_API Outline2cContext *outline2c_context_new(void);
+
+OUTLINE2C_API void outline2c_context_free(Outline2cContext *self);
+
+/**
+ * Compiles a block of text held in memory. The file name is for error
+ * messages and for finding included files relative to the input. Included
+ * files come from the resolver, or from the disk if the resolver is 0.
+ *
+ * On success, returns 1 and sets the output to a null-terminated block of
+ * generated text, which the caller frees with outline2c_free_output.
+ * On failure, returns 0, and outline2c_errors describes the problem. A
+ * context which runs out of memory can only be freed after that.
+ */
+OUTLINE2C_API int outline2c_compile(Outline2cContext *self,
+  char const *filename, char const *text, size_t size,
+  Outline2cResolveFn resolve, void *data, char **output, size_t *output_size);
+
+/**
+ * Returns the error messages from the last compile, or an empty string.
+ */
+OUTLINE2C_API char const *outline2c_errors(Outline2cContext *self);
+
+OUTLINE2C_API void outline2c_free_output(char *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
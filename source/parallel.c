@@ -0,0 +1,138 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Once parsing is done, the top-level nodes in a file do not depend on each
+ * other, so they can be generated on several threads at once. Each node
+ * produces its text in a private buffer, and the calling thread copies the
+ * finished buffers to the real output in their original order.
+ */
+
+/**
+ * State shared between the worker threads.
+ */
+typedef struct {
+  Pool *pool;           /* Worker pools are merged in here at the end */
+  ListNode *next;       /* The next node waiting to be generated */
+  int next_index;
+  int failed;           /* Set once any node fails, to stop handing out more */
+  Buffer *buffers;      /* One per top-level node */
+  int *status;          /* 0 while pending, then 1 for success, -1 for failure */
+  Mutex lock;
+  Cond done;
+  Context *context;     /* The workers share the caller's context */
+} Jobs;
+
+static void jobs_worker(void *data)
+{
+  Jobs *self = data;
+  Pool pool;
+
+  context_set(self->context);
+  pool = pool_init(0x10000);
+
+  mutex_lock(&self->lock);
+  while (self->next && !self->failed) {
+    ListNode *node = self->next;
+    int i = self->next_index;
+    int rv;
+    self->next = node->next;
+    ++self->next_index;
+    mutex_unlock(&self->lock);
+
+    self->buffers[i] = buffer_init(0x1000);
+    rv = generate(&pool, &self->buffers[i], node->d);
+
+    mutex_lock(&self->lock);
+    self->status[i] = rv ? 1 : -1;
+    if (!rv) self->failed = 1;
+    cond_broadcast(&self->done);
+  }
+
+  /* Things like included files may still refer to this memory. Outlines
+   * parsed on first use can add to the same pool, under the include lock: */
+  rmutex_lock(&self->context->include_lock);
+  pool_adopt(self->pool, &pool);
+  rmutex_unlock(&self->context->include_lock);
+  mutex_unlock(&self->lock);
+}
+
+/**
+ * Generates a list of top-level nodes using several threads, writing the
+ * results to the output in order.
+ */
+int generate_parallel(Pool *pool, Buffer *out, ListNode *code, int jobs)
+{
+  Jobs self;
+  Thread *threads;
+  int count = list_length(code);
+  int started, i, rv = 1;
+
+  if (jobs < 2 || count < 2)
+    return generate_code(pool, out, code);
+  if (count < jobs)
+    jobs = count;
+
+  self.pool = pool;
+  self.context = context_get();
+  self.next = code;
+  self.next_index = 0;
+  self.failed = 0;
+  self.buffers = (Buffer*)calloc(count, sizeof(Buffer));
+  CHECK_MEMORY(self.buffers);
+  self.status = (int*)calloc(count, sizeof(int));
+  CHECK_MEMORY(self.status);
+  mutex_init(&self.lock);
+  cond_init(&self.done);
+
+  threads = (Thread*)malloc(jobs*sizeof(Thread));
+  CHECK_MEMORY(threads);
+  for (started = 0; started < jobs; ++started)
+    if (!thread_start(&threads[started], jobs_worker, &self))
+      break;
+  if (!started) {
+    context_error("error: Could not start any worker threads.\n");
+    rv = 0;
+  }
+
+  /* Write each buffer as soon as it is ready: */
+  for (i = 0; rv && i < count; ++i) {
+    mutex_lock(&self.lock);
+    while (!self.status[i] && !(self.failed && self.next_index <= i))
+      cond_wait(&self.done, &self.lock);
+    if (self.status[i] != 1) rv = 0;
+    mutex_unlock(&self.lock);
+
+    if (rv && !buffer_write(out, self.buffers[i].p, self.buffers[i].end)) {
+      mutex_lock(&self.lock);
+      self.failed = 1;
+      mutex_unlock(&self.lock);
+      rv = 0;
+    }
+    buffer_free(&self.buffers[i]);
+  }
+
+  /* Clean up: */
+  for (i = 0; i < started; ++i)
+    thread_join(threads[i]);
+  for (i = 0; i < count; ++i)
+    free(self.buffers[i].p);
+  free(threads);
+  free(self.buffers);
+  free(self.status);
+  cond_free(&self.done);
+  mutex_free(&self.lock);
+  return rv;
+}
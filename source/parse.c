@@ -24,6 +24,39 @@
  */
 
 int parse_macro_call(Pool *pool, Source *in, Scope *scope, OutRoutine or, AstMacro *macro);
+int include_file(Pool *pool, Source *in, char const *start, String filename,
+  Scope *scope, int isolated);
+int parse_tag_value(AstOutlineTag *self);
+int generate_code(Pool *pool, Buffer *out, ListNode *node);
+
+/**
+ * Follows any ".name" member accesses after a value, replacing the value
+ * with the outline item each one names.
+ */
+int parse_members(Pool *pool, Source *in, Dynamic *value)
+{
+  char const *start;
+  Token token;
+  AstOutlineItem *item;
+
+  while (1) {
+    token = lex_next(&start, &in->cursor, in->data.end);
+    if (token != LEX_DOT) {
+      in->cursor = start;
+      return 1;
+    }
+    if (!can_get_items(*value))
+      return source_error(start, "Only outlines and outline items have members.");
+
+    token = lex_next(&start, &in->cursor, in->data.end);
+    if (token != LEX_IDENTIFIER)
+      return source_error(start, "Expecting an item name after the dot.");
+    CHECK(get_item_by_name(*value, string(start, in->cursor), &item));
+    if (!item)
+      return source_error(start, "There is no item with this name.");
+    *value = dynamic(type_outline_item, item);
+  }
+}
 
 /**
  * Parses an outline2c expression.
@@ -57,10 +90,12 @@ int parse_value(Pool *pool, Source *in, Scope *scope, OutRoutine or, int allow_a
 
   if (!scope_get(scope, &out, name))
     return source_error(start, "Unknown variable or keyword.");
-  if (out.type == type_keyword)
+  if (out.type == type_keyword) {
     CHECK(((Keyword*)out.p)->code(pool, in, scope, or));
-  else
+  } else {
+    CHECK(parse_members(pool, in, &out));
     CHECK(or.code(or.data, out));
+  }
   return 1;
 }
 
@@ -357,31 +392,30 @@ int parse_outline_item(Pool *pool, Source *in, Scope *scope, OutRoutine or)
   ListBuilder tags = list_builder_init(pool);
   AstOutlineItem *self = pool_new(pool, AstOutlineItem);
 
+  /* Tag values see the definitions made so far, even when parsed later: */
+  scope = scope_snapshot(pool, scope);
+
   /* Handle the words making up the item: */
   token = lex_next(&start, &in->cursor, in->data.end);
   while (token == LEX_IDENTIFIER) {
     if (string_size(last)) {
       list_builder_add(&tags, dynamic(type_outline_tag,
-        ast_outline_tag_new(pool, last, 0)));
+        ast_outline_tag_new(pool, last, string_null(), scope)));
     }
     last = string(start, in->cursor);
     token = lex_next(&start, &in->cursor, in->data.end);
     if (token == LEX_EQUALS) {
-      Scope *inner = scope_new(pool, scope);
       Source block;
-      ListBuilder code = list_builder_init(pool);
 
-      /* Block: */
+      /* Block, parsed on first use: */
       start = in->cursor;
       block = lex_block(in);
       if (!block.cursor)
         return source_error(start, "A tag's value must be a code block.");
 
-      /* Value: */
-      CHECK(parse_code(pool, &block, inner, out_list_builder(&code)));
-
       list_builder_add(&tags, dynamic(type_outline_tag,
-        ast_outline_tag_new(pool, last, code.first)));
+        ast_outline_tag_new(pool, last,
+          string(block.cursor, block.data.end), scope)));
 
       last = string_null();
       token = lex_next(&start, &in->cursor, in->data.end);
@@ -408,49 +442,487 @@ int parse_outline_item(Pool *pool, Source *in, Scope *scope, OutRoutine or)
 }
 
 /**
- * Parses a list of outline items.
+ * Parses a list of outline items. This only finds the end of the list, and
+ * leaves the items themselves until something uses them, since a library
+ * of definitions may hold many outlines that a given file never touches.
  */
 int parse_outline(Pool *pool, Source *in, Scope *scope, OutRoutine or)
 {
   char const *start;
-  Token token;
-  ListBuilder items = list_builder_init(pool);
   AstOutline *self = pool_new(pool, AstOutline);
 
-  /* Opening brace: */
-  token = lex_next(&start, &in->cursor, in->data.end);
-  if (token != LEX_BRACE_L)
-    return source_error(start, "An outline must start with an opening {.");
+  /* Block: */
+  start = in->cursor;
+  self->code = lex_block(in);
+  if (!self->code.cursor)
+    return source_error(start, "An outline must be a list of items between braces.");
+  self->items = 0;
+  self->source = dynamic_none();
+  self->scope = scope_snapshot(pool, scope);
+  self->pool = pool;
+  self->parsed = 0;
+  self->subsets = 0;
+  self->index = 0;
+  self->orders = 0;
 
-  /* Items: */
-  token = lex_next(&start, &in->cursor, in->data.end);
-  while (token != LEX_BRACE_R) {
-    in->cursor = start;
-    CHECK(parse_outline_item(pool, in, scope, out_list_builder(&items)));
-    token = lex_next(&start, &in->cursor, in->data.end);
+  CHECK(or.code(or.data, dynamic(type_outline, self)));
+  return 1;
+}
+
+/**
+ * Finds the value of an item's tag, generated the same way a lookup would
+ * generate it, then without surrounding space, for comparing with other
+ * values. This way {a} and { a } match, and so do a macro call and its
+ * expansion. Sets the tag to 0 if the item has no value for it.
+ */
+int tag_value_key(Pool *pool, AstOutlineItem *item, String name,
+  AstOutlineTag **tag, String *key)
+{
+  ListNode *node, *value;
+  Buffer b;
+  int rv;
+
+  *tag = 0;
+  for (node = item->tags; node; node = node->next) {
+    AstOutlineTag *t = ast_to_outline_tag(node->d);
+    if (t->text.p && string_equal(t->name, name)) {
+      *tag = t;
+      break;
+    }
+  }
+  if (!*tag) return 1;
+  CHECK(parse_tag_value(*tag));
+  value = (*tag)->value;
+
+  /* Plain text needs no generating: */
+  if (!value) {
+    *key = string((*tag)->text.p, (*tag)->text.p);
+  } else if (!value->next && value->d.type == type_code_text) {
+    *key = ((AstCodeText*)value->d.p)->code;
+  } else {
+    b = buffer_init(0x100);
+    rv = generate_code(pool, &b, value);
+    *key = string_copy(pool, string(b.p, b.end));
+    buffer_free(&b);
+    CHECK(rv);
+  }
+
+  while (key->p < key->end && (IS_SPACE(key->p[0]) || IS_NEWLINE(key->p[0])))
+    ++key->p;
+  while (key->p < key->end && (IS_SPACE(key->end[-1]) || IS_NEWLINE(key->end[-1])))
+    --key->end;
+  return 1;
+}
+
+/**
+ * A group item under construction.
+ */
+typedef struct {
+  AstOutline *members;
+  ListBuilder items;
+} ParseGroup;
+
+/**
+ * Gathers the items in a group's outline into one item per tag value, in a
+ * single pass. The groups appear in the order their values first appear,
+ * and keep their members in order. Items without a value for the tag are
+ * left out.
+ */
+int parse_group_items(AstOutline *self, AstGroup *group)
+{
+  ListBuilder groups = list_builder_init(self->pool);
+  ListNode *item;
+  HashTable index;
+
+  CHECK(get_items(group->outline, &item));
+  hash_table_init(&index, self->pool, list_length(item));
+  for (; item; item = item->next) {
+    AstOutlineTag *value;
+    ParseGroup *g;
+    String key;
+
+    CHECK(tag_value_key(self->pool, ast_to_outline_item(item->d),
+      group->tag, &value, &key));
+    if (!value) continue;
+
+    g = hash_table_get(&index, key);
+    if (!g) {
+      AstOutlineItem *g_item = pool_new(self->pool, AstOutlineItem);
+      ListBuilder g_tags = list_builder_init(self->pool);
+
+      /* The group's name is the key, and it keeps the tag: */
+      list_builder_add(&g_tags, dynamic(type_outline_tag, value));
+      g_item->tags = g_tags.first;
+      g_item->name = string_copy(self->pool, key);
+      g_item->children = ast_outline_new(self->pool, 0);
+
+      g = pool_new(self->pool, ParseGroup);
+      g->members = g_item->children;
+      g->items = list_builder_init(self->pool);
+      hash_table_add(&index, key, g);
+      list_builder_add(&groups, dynamic(type_outline_item, g_item));
+    }
+    list_builder_add(&g->items, item->d);
+    g->members->items = g->items.first;
+  }
+
+  self->items = groups.first;
+  self->parsed = 1;
+  return 1;
+}
+
+/**
+ * Finds an item's key for a join, which is either a tag value or the item's
+ * name. The key is null if the item has no value for the tag.
+ */
+int join_key(Pool *pool, AstOutlineItem *item, String tag, String *key)
+{
+  AstOutlineTag *value;
+
+  if (!tag.p) {
+    *key = item->name;
+    return 1;
+  }
+  CHECK(tag_value_key(pool, item, tag, &value, key));
+  if (!value) *key = string_null();
+  return 1;
+}
+
+/**
+ * Pairs the items from a join's outlines, by looking up each item on the
+ * left in a hash table of the items on the right. The pairs follow the
+ * order of the left outline, then the right one. Each pair is a copy of the
+ * left item with the right item's tags after its own, and with both items as
+ * its children.
+ */
+int parse_join_items(AstOutline *self, AstJoin *join)
+{
+  ListBuilder pairs = list_builder_init(self->pool);
+  ListNode *left, *right, *node;
+  HashTable index;
+
+  /* Index the right side: */
+  CHECK(get_items(join->right, &right));
+  hash_table_init(&index, self->pool, list_length(right));
+  for (; right; right = right->next) {
+    ListBuilder *matches;
+    String key;
+
+    CHECK(join_key(self->pool, ast_to_outline_item(right->d), join->right_tag, &key));
+    if (!key.p) continue;
+    matches = hash_table_get(&index, key);
+    if (!matches) {
+      matches = pool_new(self->pool, ListBuilder);
+      *matches = list_builder_init(self->pool);
+      hash_table_add(&index, key, matches);
+    }
+    list_builder_add(matches, right->d);
   }
+
+  /* Look up the left side: */
+  CHECK(get_items(join->left, &left));
+  for (; left; left = left->next) {
+    AstOutlineItem *l = ast_to_outline_item(left->d);
+    ListBuilder *matches;
+    String key;
+
+    CHECK(join_key(self->pool, l, join->left_tag, &key));
+    if (!key.p) continue;
+    matches = hash_table_get(&index, key);
+    for (right = matches ? matches->first : 0; right; right = right->next) {
+      AstOutlineItem *pair = pool_new(self->pool, AstOutlineItem);
+      ListBuilder tags = list_builder_init(self->pool);
+      ListBuilder sides = list_builder_init(self->pool);
+
+      for (node = l->tags; node; node = node->next)
+        list_builder_add(&tags, node->d);
+      for (node = ast_to_outline_item(right->d)->tags; node; node = node->next)
+        list_builder_add(&tags, node->d);
+      list_builder_add(&sides, left->d);
+      list_builder_add(&sides, right->d);
+
+      pair->tags = tags.first;
+      pair->name = l->name;
+      pair->children = ast_outline_new(self->pool, sides.first);
+      list_builder_add(&pairs, dynamic(type_outline_item, pair));
+    }
+  }
+
+  self->items = pairs.first;
+  self->parsed = 1;
+  return 1;
+}
+
+/**
+ * Adds a tag with a number for its value to a list of tags.
+ */
+static void parse_number_tag(Pool *pool, ListBuilder *tags, char const *name, long n)
+{
+  char number[32];
+
+  sprintf(number, "%ld", n);
+  list_builder_add(tags, dynamic(type_outline_tag,
+    ast_outline_tag_text(pool, string_from_c(name), string_from_c(number))));
+}
+
+/**
+ * Works out a minimal perfect hash for the items in an outline, then lists
+ * them in slot order. Each item is a copy of the original with two tags in
+ * front of its own: "slot" holds its slot number, and "seed" holds the seed
+ * for the bucket with the same number, so one loop can write out both the
+ * keys and the seeds. Items without a key are left out, and a key written as
+ * a string literal is hashed without its quotes.
+ */
+int parse_perfect_hash_items(AstOutline *self, AstPerfectHash *perfect)
+{
+  ListBuilder items = list_builder_init(self->pool);
+  ListNode *item, **nodes, **by_slot;
+  String *keys;
+  int32_t *seeds;
+  size_t *slots;
+  size_t count, n, i;
+  HashSet seen;
+  int rv = 1;
+
+  CHECK(get_items(perfect->outline, &item));
+  count = list_length(item);
+  keys = (String*)pool_alloc(self->pool, (count + 1)*sizeof(String), alignof(String));
+  nodes = (ListNode**)pool_alloc(self->pool, (count + 1)*sizeof(ListNode*), alignof(ListNode*));
+  by_slot = (ListNode**)pool_alloc(self->pool, (count + 1)*sizeof(ListNode*), alignof(ListNode*));
+
+  /* Keys: */
+  hash_set_init(&seen, count);
+  for (n = 0; rv && item; item = item->next) {
+    rv = join_key(self->pool, ast_to_outline_item(item->d), perfect->tag, &keys[n]);
+    if (!rv || !keys[n].p) continue;
+    if (2 <= string_size(keys[n]) && keys[n].p[0] == '"' && keys[n].end[-1] == '"') {
+      /* Generated code looks up the string, not the literal: */
+      ++keys[n].p;
+      --keys[n].end;
+    }
+    if (!hash_set_add(&seen, keys[n]))
+      rv = source_error(perfect->start, "Two items in this perfect hash have the same key.");
+    nodes[n++] = item;
+  }
+  hash_set_free(&seen);
+  CHECK(rv);
+
+  /* Slots: */
+  seeds = (int32_t*)pool_alloc(self->pool, (n + 1)*sizeof(int32_t), alignof(int32_t));
+  slots = (size_t*)pool_alloc(self->pool, (n + 1)*sizeof(size_t), alignof(size_t));
+  if (n && !hash_perfect(keys, n, seeds, slots))
+    return source_error(perfect->start, "Could not find a perfect hash for these keys.");
+
+  /* Items, in slot order: */
+  for (i = 0; i < n; ++i)
+    by_slot[slots[i]] = nodes[i];
+  for (i = 0; i < n; ++i) {
+    AstOutlineItem *original = ast_to_outline_item(by_slot[i]->d);
+    AstOutlineItem *copy = pool_new(self->pool, AstOutlineItem);
+    ListBuilder tags = list_builder_init(self->pool);
+    ListNode *tag;
+
+    parse_number_tag(self->pool, &tags, "slot", (long)i);
+    parse_number_tag(self->pool, &tags, "seed", (long)seeds[i]);
+    for (tag = original->tags; tag; tag = tag->next)
+      list_builder_add(&tags, tag->d);
+    copy->tags = tags.first;
+    copy->name = original->name;
+    copy->children = original->children;
+    list_builder_add(&items, dynamic(type_outline_item, copy));
+  }
+
   self->items = items.first;
+  self->parsed = 1;
+  return 1;
+}
 
-  CHECK(or.code(or.data, dynamic(type_outline, self)));
+/**
+ * Gathers a union's items from its parts, dropping repeated names and
+ * sorting them if the union asks for that.
+ */
+int parse_union_items(AstOutline *self, AstUnion *u)
+{
+  ListBuilder items = list_builder_init(self->pool);
+  ListNode *part, *item;
+  HashSet seen;
+  int rv = 1;
+
+  if (u->distinct) hash_set_init(&seen, 0);
+  for (part = u->parts; rv && part; part = part->next) {
+    AstUnionPart *up = part->d.p;
+    rv = get_filtered_items(self->pool, up->outline, up->filter, &item);
+    for (; rv && item; item = item->next)
+      if (!u->distinct || hash_set_add(&seen, ast_to_outline_item(item->d)->name))
+        list_builder_add(&items, item->d);
+  }
+  if (u->distinct) hash_set_free(&seen);
+  if (rv && u->sorted) {
+    ListNode **order;
+    size_t count, i;
+    order = sort_items(self->pool, items.first, u->sort_tag, &count);
+    rv = !!order;
+    items = list_builder_init(self->pool);
+    for (i = 0; i < count; ++i)
+      list_builder_add(&items, order[i]->d);
+  }
+  if (rv) {
+    self->items = items.first;
+    self->parsed = 1;
+  }
+  return rv;
+}
+
+/**
+ * Parses an outline's items the first time they are needed, or builds them
+ * from the outline's source. They go in the pool the outline came from, so
+ * they last as long as it does. Generator threads can get here at the same
+ * time, so this holds the include lock, which already guards the include
+ * cache's pool.
+ */
+int parse_outline_body(AstOutline *self)
+{
+  Context *context = context_get();
+  char const *start;
+  Token token;
+  Source in;
+  ListBuilder items;
+  Dynamic source = self->source;
+  int rv = 1;
+
+  rmutex_lock(&context->include_lock);
+  if (self->parsed) {
+    /* Another thread got here first. */
+  } else if (source.type == type_range) {
+    AstRange *range = source.p;
+    long n;
+    items = list_builder_init(self->pool);
+    for (n = range->first; n < range->end; ++n)
+      list_builder_add(&items, dynamic(type_outline_item,
+        ast_range_item(self->pool, range, n)));
+    self->items = items.first;
+    self->parsed = 1;
+  } else if (source.type == type_group) {
+    rv = parse_group_items(self, source.p);
+  } else if (source.type == type_join) {
+    rv = parse_join_items(self, source.p);
+  } else if (source.type == type_perfect_hash) {
+    rv = parse_perfect_hash_items(self, source.p);
+  } else if (source.type == type_outline_load) {
+    AstOutlineLoad *load = source.p;
+    rv = load->load(self, load->data);
+  } else if (source.type == type_union) {
+    rv = parse_union_items(self, source.p);
+  } else {
+    assert(source.type == type_none);
+    in = self->code;
+    items = list_builder_init(self->pool);
+    token = lex_next(&start, &in.cursor, in.data.end);
+    while (rv && token != LEX_END) {
+      in.cursor = start;
+      rv = parse_outline_item(self->pool, &in, self->scope, out_list_builder(&items));
+      token = lex_next(&start, &in.cursor, in.data.end);
+    }
+    if (rv) {
+      self->items = items.first;
+      self->parsed = 1;
+    }
+  }
+  rmutex_unlock(&context->include_lock);
+  return rv;
+}
+
+/**
+ * Parses a tag's value the first time it is looked up, in the same way as
+ * an outline body.
+ */
+int parse_tag_value(AstOutlineTag *self)
+{
+  Context *context = context_get();
+  Source *source;
+  Source block;
+  ListBuilder code;
+  int rv = 1;
+
+  rmutex_lock(&context->include_lock);
+  source = self->parsed ? 0 : source_find(self->text.p);
+  if (!self->parsed && !source) {
+    context_error("error: Could not find the source text for tag \"%.*s\".\n",
+      (int)string_size(self->name), self->name.p);
+    rv = 0;
+  } else if (!self->parsed) {
+    block = *source;
+    block.cursor = self->text.p;
+    block.data.end = self->text.end;
+    code = list_builder_init(self->pool);
+    rv = parse_code(self->pool, &block, scope_new(self->pool, self->scope),
+      out_list_builder(&code));
+    if (rv) {
+      self->value = code.first;
+      self->parsed = 1;
+    }
+  }
+  rmutex_unlock(&context->include_lock);
+  return rv;
+}
+
+/**
+ * Parses the rest of a "sorted" modifier, which may name a tag to sort by.
+ * Otherwise, the tag is null, meaning the items sort by name.
+ */
+int parse_sorted(Source *in, String *tag)
+{
+  char const *start;
+  Token token;
+
+  *tag = string_null();
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token == LEX_IDENTIFIER &&
+    string_equal(string(start, in->cursor), string_from_k("by"))) {
+    token = lex_next(&start, &in->cursor, in->data.end);
+    if (token != LEX_IDENTIFIER)
+      return source_error(start, "Expecting a tag name to sort by.");
+    *tag = string(start, in->cursor);
+  } else {
+    in->cursor = start;
+  }
   return 1;
 }
 
 /**
- * Parses a union of outlines
+ * Parses a union of outlines. This only notes which outlines and filters
+ * make up the union, without touching any items, so building one costs the
+ * same no matter how large the outlines are. With the "distinct" modifier,
+ * only the first item with any given name makes it into the union, and with
+ * the "sorted" modifier, the items end up in order.
  */
 int parse_union(Pool *pool, Source *in, Scope *scope, OutRoutine or)
 {
   char const *start;
   Token token;
   Dynamic out;
-  ListNode *items_in;
+  Dynamic outline;
   Dynamic filter;
-  ListBuilder items = list_builder_init(pool);
-  ListNode *item;
-  AstOutline *self = pool_new(pool, AstOutline);
+  ListBuilder parts = list_builder_init(pool);
+  int distinct = 0, sorted = 0;
+  String sort_tag = string_null();
 
-  /* Opening brace: */
+  /* "distinct" and "sorted" modifiers: */
   token = lex_next(&start, &in->cursor, in->data.end);
+  while (token == LEX_IDENTIFIER) {
+    String s = string(start, in->cursor);
+    if (string_equal(s, string_from_k("distinct"))) {
+      distinct = 1;
+    } else if (string_equal(s, string_from_k("sorted"))) {
+      CHECK(parse_sorted(in, &sort_tag));
+      sorted = 1;
+    } else {
+      return source_error(start, "Only the \"distinct\" and \"sorted\" modifiers are allowed here.");
+    }
+    token = lex_next(&start, &in->cursor, in->data.end);
+  }
+
+  /* Opening brace: */
   if (token != LEX_BRACE_L)
     return source_error(start, "Expecting an opening {.");
 
@@ -460,7 +932,7 @@ outline:
   CHECK(parse_value(pool, in, scope, out_dynamic(&out), 0));
   if (!can_get_items(out))
     return source_error(start, "Wrong type - the union statement expects an outline.\n");
-  items_in = get_items(out);
+  outline = out;
 
   /* Map? */
   token = lex_next(&start, &in->cursor, in->data.end);
@@ -477,10 +949,8 @@ outline:
     filter = dynamic_none();
   }
 
-  /* Process items: */
-  for (item = items_in; item; item = item->next)
-    if (!dynamic_ok(filter) || test_filter(filter, ast_to_outline_item(item->d)))
-      list_builder_add(&items, item->d);
+  list_builder_add(&parts, dynamic(type_union_part,
+    ast_union_part_new(pool, outline, filter)));
 
   /* Another outline? */
   if (token == LEX_COMMA) {
@@ -489,8 +959,201 @@ outline:
     return source_error(start, "The list of outlines must end with a closing }.");
   }
 
-  self->items = items.first;
-  CHECK(or.code(or.data, dynamic(type_outline, self)));
+  CHECK(or.code(or.data, dynamic(type_outline, ast_union_new(pool, parts.first,
+    distinct, sorted, sort_tag))));
+  return 1;
+}
+
+/**
+ * Parses a group statement, such as group big by category, which gathers
+ * an outline's items into one group per value of a tag.
+ */
+int parse_group(Pool *pool, Source *in, Scope *scope, OutRoutine or)
+{
+  char const *start;
+  Token token;
+  Dynamic outline;
+
+  /* Outline: */
+  start = in->cursor;
+  CHECK(parse_value(pool, in, scope, out_dynamic(&outline), 0));
+  if (!can_get_items(outline))
+    return source_error(start, "Wrong type - the group statement expects an outline.");
+
+  /* Tag: */
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token != LEX_IDENTIFIER ||
+    !string_equal(string(start, in->cursor), string_from_k("by")))
+    return source_error(start, "Expecting the word \"by\" and a tag name.");
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token != LEX_IDENTIFIER)
+    return source_error(start, "Expecting a tag name to group by.");
+
+  CHECK(or.code(or.data, dynamic(type_outline,
+    ast_group_new(pool, outline, string(start, in->cursor)))));
+  return 1;
+}
+
+/**
+ * Parses one side of a join statement, which is an outline and an optional
+ * tag to match on.
+ */
+int parse_join_side(Pool *pool, Source *in, Scope *scope, Dynamic *outline,
+  String *tag)
+{
+  char const *start;
+  Token token;
+
+  start = in->cursor;
+  CHECK(parse_value(pool, in, scope, out_dynamic(outline), 0));
+  if (!can_get_items(*outline))
+    return source_error(start, "Wrong type - the join statement expects an outline.");
+
+  /* Tag? */
+  *tag = string_null();
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token == LEX_IDENTIFIER) {
+    if (!string_equal(string(start, in->cursor), string_from_k("by")))
+      return source_error(start, "Only \"by\" and a tag name are allowed here.");
+    token = lex_next(&start, &in->cursor, in->data.end);
+    if (token != LEX_IDENTIFIER)
+      return source_error(start, "Expecting a tag name to join by.");
+    *tag = string(start, in->cursor);
+    token = lex_next(&start, &in->cursor, in->data.end);
+  }
+  in->cursor = start;
+  return 1;
+}
+
+/**
+ * Parses a join statement, such as join{messages by id, handlers by id},
+ * which pairs up the items from two outlines with matching keys.
+ */
+int parse_join(Pool *pool, Source *in, Scope *scope, OutRoutine or)
+{
+  char const *start;
+  Token token;
+  Dynamic left, right;
+  String left_tag, right_tag;
+
+  /* Opening brace: */
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token != LEX_BRACE_L)
+    return source_error(start, "Expecting an opening {.");
+
+  /* Left side: */
+  CHECK(parse_join_side(pool, in, scope, &left, &left_tag));
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token != LEX_COMMA)
+    return source_error(start, "A join needs a comma and a second outline.");
+
+  /* Right side: */
+  CHECK(parse_join_side(pool, in, scope, &right, &right_tag));
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token != LEX_BRACE_R)
+    return source_error(start, "A join must end with a closing } after two outlines.");
+
+  CHECK(or.code(or.data, dynamic(type_outline,
+    ast_join_new(pool, left, left_tag, right, right_tag))));
+  return 1;
+}
+
+/**
+ * Parses a perfect_hash statement, such as perfect_hash keywords or
+ * perfect_hash keywords by text, which arranges an outline's items into a
+ * table that generated code can look keys up in with one comparison.
+ */
+int parse_perfect_hash(Pool *pool, Source *in, Scope *scope, OutRoutine or)
+{
+  char const *start, *outline_start;
+  Token token;
+  Dynamic outline;
+  String tag = string_null();
+
+  /* Outline: */
+  lex_next(&outline_start, &in->cursor, in->data.end);
+  in->cursor = outline_start;
+  CHECK(parse_value(pool, in, scope, out_dynamic(&outline), 0));
+  if (!can_get_items(outline))
+    return source_error(outline_start, "Wrong type - the perfect_hash statement expects an outline.");
+
+  /* Tag? */
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token == LEX_IDENTIFIER &&
+    string_equal(string(start, in->cursor), string_from_k("by"))) {
+    token = lex_next(&start, &in->cursor, in->data.end);
+    if (token != LEX_IDENTIFIER)
+      return source_error(start, "Expecting a tag name to hash by.");
+    tag = string(start, in->cursor);
+  } else {
+    in->cursor = start;
+  }
+
+  CHECK(or.code(or.data, dynamic(type_outline,
+    ast_perfect_hash_new(pool, outline_start, outline, tag))));
+  return 1;
+}
+
+/**
+ * Reads one of the numbers in a range statement.
+ */
+int parse_range_number(Source *in, char const **start, long *n)
+{
+  char number[32];
+  char *end;
+  Token token;
+
+  token = lex_next(start, &in->cursor, in->data.end);
+  if (token != LEX_NUMBER || sizeof(number) <= (size_t)(in->cursor - *start))
+    return source_error(*start, "Expecting a number here.");
+  memcpy(number, *start, in->cursor - *start);
+  number[in->cursor - *start] = 0;
+  errno = 0;
+  *n = strtol(number, &end, 0);
+  if (*end || errno)
+    return source_error(*start, "This is not a number outline2c understands.");
+  return 1;
+}
+
+/**
+ * Parses a range statement, which makes an outline of numbered items, such
+ * as range(0, 4, r) for r0, r1, r2 and r3. The items are only made as
+ * something needs them.
+ */
+int parse_range(Pool *pool, Source *in, Scope *scope, OutRoutine or)
+{
+  char const *start;
+  Token token;
+  long first, end;
+  String prefix = string_null();
+
+  /* Opening parenthesis: */
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token != LEX_PAREN_L)
+    return source_error(start, "A range must begin with an argument list.");
+
+  /* Numbers: */
+  CHECK(parse_range_number(in, &start, &first));
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token != LEX_COMMA)
+    return source_error(start, "Expecting a comma and the end of the range.");
+  CHECK(parse_range_number(in, &start, &end));
+  if (end < first)
+    return source_error(start, "A range cannot end before it starts.");
+
+  /* Name prefix? */
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token == LEX_COMMA) {
+    token = lex_next(&start, &in->cursor, in->data.end);
+    if (token != LEX_IDENTIFIER)
+      return source_error(start, "Expecting a prefix for the item names.");
+    prefix = string(start, in->cursor);
+    token = lex_next(&start, &in->cursor, in->data.end);
+  }
+  if (token != LEX_PAREN_R)
+    return source_error(start, "Expecting a closing ).");
+
+  CHECK(or.code(or.data, dynamic(type_outline, ast_range_new(pool, first, end, prefix))));
   return 1;
 }
 
@@ -595,6 +1258,9 @@ int parse_for(Pool *pool, Source *in, Scope *scope, OutRoutine or)
   self->filter = dynamic_none();
   self->reverse = 0;
   self->list = 0;
+  self->shard = 0;
+  self->sorted = 0;
+  self->sort_tag = string_null();
 modifier:
   token = lex_next(&start, &in->cursor, in->data.end);
   if (token == LEX_IDENTIFIER) {
@@ -616,6 +1282,17 @@ modifier:
     } else if (string_equal(s, string_from_k("list"))) {
       self->list = 1;
       goto modifier;
+
+    /* "shard" modifier: */
+    } else if (string_equal(s, string_from_k("shard"))) {
+      self->shard = 1;
+      goto modifier;
+
+    /* "sorted" modifier: */
+    } else if (string_equal(s, string_from_k("sorted"))) {
+      CHECK(parse_sorted(in, &self->sort_tag));
+      self->sorted = 1;
+      goto modifier;
     } else {
       return source_error(start, "Invalid \"for\" statement modifier.");
     }
@@ -633,41 +1310,101 @@ modifier:
 }
 
 /**
- * Parses the "include" directive
+ * Parses an output statement. The file name is resolved later, once the
+ * compiler knows where the main output is going.
  */
-int parse_include(Pool *pool, Source *in, Scope *scope, OutRoutine or)
+int parse_output(Pool *pool, Source *in, Scope *scope, OutRoutine or)
 {
   char const *start;
   Token token;
-  char const *p, *base_end;
-  String filename;
-  Source *source;
+  Scope *inner = scope_new(pool, scope);
+  Source block;
   ListBuilder code = list_builder_init(pool);
+  AstOutput *self = pool_new(pool, AstOutput);
 
   /* File name: */
   token = lex_next(&start, &in->cursor, in->data.end);
   if (token != LEX_STRING)
-    return source_error(start, "An include statment expects a quoted filename.");
+    return source_error(start, "An output statement expects a quoted filename.");
+  self->start = start;
+  self->filename = string_copy(pool, string(start + 1, in->cursor - 1));
+
+  /* Block: */
+  start = in->cursor;
+  block = lex_block(in);
+  if (!block.cursor)
+    return source_error(start, "An output statement must end with a code block.");
+
+  /* Code: */
+  CHECK(parse_code(pool, &block, inner, out_list_builder(&code)));
+  self->code = code.first;
+
+  CHECK(or.code(or.data, dynamic(type_output, self)));
+  return 1;
+}
+
+/**
+ * Parses the "include" directive, which may end with the word "isolated".
+ */
+int parse_include(Pool *pool, Source *in, Scope *scope, OutRoutine or)
+{
+  char const *start, *name;
+  Token token;
+  String filename;
+  int isolated = 0;
+
+  /* File name: */
+  token = lex_next(&name, &in->cursor, in->data.end);
+  if (token != LEX_STRING)
+    return source_error(name, "An include statment expects a quoted filename.");
 
   /* Resolve relative paths: */
-  base_end = in->filename.p;
-  for (p = in->filename.p; p < in->filename.end; ++p)
-    if (*p == '\\' || *p == '/')
-      base_end = p + 1;
-  filename = string_cat(pool,
-    string(in->filename.p, base_end),
-    string(start + 1, in->cursor - 1));
+  filename = source_path(pool, in->filename, string(name + 1, in->cursor - 1));
 
-  /* Process the file's contents: */
-  source = source_load(pool, filename);
-  if (!source)
-    return source_error(start, "Could not open the included file.");
-  CHECK(parse_code(pool, source, scope, out_list_builder(&code)));
+  /* Modifier: */
+  token = lex_next(&start, &in->cursor, in->data.end);
+  if (token == LEX_IDENTIFIER &&
+    string_equal(string(start, in->cursor), string_from_k("isolated"))) {
+    isolated = 1;
+    token = lex_next(&start, &in->cursor, in->data.end);
+  }
 
   /* Closing semicolon: */
-  token = lex_next(&start, &in->cursor, in->data.end);
   if (token != LEX_SEMICOLON)
     return source_error(start, "An include stament must end with a semicolon.");
 
-  return 1;
+  /* Process the file's contents: */
+  return include_file(pool, in, name, filename, scope, isolated);
+}
+
+/**
+ * Creates the scope holding the built-in keywords.
+ */
+Scope *parse_keywords(Pool *pool)
+{
+  Scope *scope = scope_new(pool, 0);
+
+  scope_add(scope, pool, string_from_k("macro"), dynamic(type_keyword,
+    keyword_new(pool, parse_macro)));
+  scope_add(scope, pool, string_from_k("outline"), dynamic(type_keyword,
+    keyword_new(pool, parse_outline)));
+  scope_add(scope, pool, string_from_k("union"), dynamic(type_keyword,
+    keyword_new(pool, parse_union)));
+  scope_add(scope, pool, string_from_k("range"), dynamic(type_keyword,
+    keyword_new(pool, parse_range)));
+  scope_add(scope, pool, string_from_k("group"), dynamic(type_keyword,
+    keyword_new(pool, parse_group)));
+  scope_add(scope, pool, string_from_k("join"), dynamic(type_keyword,
+    keyword_new(pool, parse_join)));
+  scope_add(scope, pool, string_from_k("perfect_hash"), dynamic(type_keyword,
+    keyword_new(pool, parse_perfect_hash)));
+  scope_add(scope, pool, string_from_k("map"), dynamic(type_keyword,
+    keyword_new(pool, parse_map)));
+  scope_add(scope, pool, string_from_k("for"), dynamic(type_keyword,
+    keyword_new(pool, parse_for)));
+  scope_add(scope, pool, string_from_k("include"), dynamic(type_keyword,
+    keyword_new(pool, parse_include)));
+  scope_add(scope, pool, string_from_k("output"), dynamic(type_keyword,
+    keyword_new(pool, parse_output)));
+  return scope;
 }
@@ -72,15 +72,14 @@ typedef struct {
  */
 #define alignof(type) offsetof(struct { char c; type data; }, data)
 
+void memory_error(char const *file, int line);
+
 /**
- * Verifies that a memory-allocating call succeeds, and aborts the program
- * otherwise.
+ * Verifies that a memory-allocating call succeeds. Otherwise, the current
+ * context decides what happens, which is normally aborting the program.
  */
 #define CHECK_MEMORY(p) do { \
-  if (!(p)) { \
-    fprintf(stderr, "error: Out of memory at %s:%d\n", __FILE__, __LINE__); \
-    abort(); \
-  } \
+  if (!(p)) memory_error(__FILE__, __LINE__); \
 } while(0)
 
 /**
@@ -126,6 +125,22 @@ void pool_free(Pool *self)
   }
 }
 
+/**
+ * Moves all the memory owned by another pool into this one, so it will be
+ * freed along with this pool's memory. The other pool is no longer usable
+ * after calling this function.
+ */
+void pool_adopt(Pool *self, Pool *other)
+{
+  char *last = other->block;
+  while (*(char**)last)
+    last = *(char**)last;
+
+  /* Splice the other pool's blocks in behind the current block: */
+  *(char**)last = *(char**)self->block;
+  *(char**)self->block = other->block;
+}
+
 /**
  * Allocates memory using malloc and adds the result to the pool's list of
  * blocks to free.
@@ -143,6 +158,27 @@ void *pool_alloc_sys(Pool *self, size_t size, size_t align)
   return block + padding;
 }
 
+/**
+ * Resizes a block which came from pool_alloc_sys, using the same alignment.
+ * The block may move. This is for things like reading a stream of unknown
+ * length, where the final size is not known up front.
+ */
+void *pool_realloc_sys(Pool *self, void *p, size_t size, size_t align)
+{
+  size_t padding = sizeof(char*) < align ? align : sizeof(char*);
+  char *old = (char*)p - padding;
+  char **link, *block;
+
+  /* Find the pointer to the block in the list of stuff to free: */
+  for (link = (char**)self->block; *link != old; link = (char**)*link)
+    ;
+  block = (char*)realloc(old, padding + size);
+  CHECK_MEMORY(block);
+  *link = block;
+
+  return block + padding;
+}
+
 /**
  * Allocates memory from the pool.
  */
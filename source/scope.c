@@ -35,6 +35,7 @@ typedef struct Scope Scope;
 struct Scope {
   Scope *outer;
   Symbol *first;
+  int frozen;             /* A snapshot, which never gains symbols */
 };
 
 Scope *scope_new(Pool *pool, Scope *outer)
@@ -42,6 +43,26 @@ Scope *scope_new(Pool *pool, Scope *outer)
   Scope *self = pool_new(pool, Scope);
   self->outer = outer;
   self->first = 0;
+  self->frozen = 0;
+  return self;
+}
+
+/**
+ * Captures the symbols visible from a scope right now. New symbols go on
+ * the front of each level's list, so a copy of each level's current first
+ * symbol keeps seeing exactly what was there, even after more get added.
+ * Anything parsed later against a snapshot resolves names the same way it
+ * would have when the snapshot was taken.
+ */
+Scope *scope_snapshot(Pool *pool, Scope *scope)
+{
+  Scope *self;
+
+  if (!scope || scope->frozen) return scope;
+  self = pool_new(pool, Scope);
+  self->outer = scope_snapshot(pool, scope->outer);
+  self->first = scope->first;
+  self->frozen = 1;
   return self;
 }
 
@@ -51,6 +72,7 @@ Scope *scope_new(Pool *pool, Scope *outer)
 void scope_add(Scope *scope, Pool *pool, String name, Dynamic value)
 {
   Symbol *sym = pool_new(pool, Symbol);
+  assert(!scope->frozen);
   sym->name = string_copy(pool, name);
   sym->value = value;
   sym->next = scope->first;
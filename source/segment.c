@@ -0,0 +1,257 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Incremental regeneration. Each top-level node in the input produces one
+ * contiguous piece of the output, so with --incremental the compiler saves
+ * a segment map next to the output, recording where each node's text came
+ * from and went to. On the next run, any node whose input text and
+ * surroundings are unchanged is copied out of the previous output instead of
+ * being generated again.
+ *
+ * A node's output depends on its own input text plus the definitions it can
+ * see. Macro bodies are expanded late, so they can see any definition in the
+ * file, and the surroundings hash therefore covers every stretch of the
+ * input which defines something, along with every included file. Editing
+ * plain template text only costs the nodes that were touched, while editing
+ * a definition regenerates everything.
+ *
+ * Includes inside macro and for bodies only load while generating, and a
+ * copied segment never generates, so the surroundings also cover every file
+ * the dependency scan finds. If generating still loads a file the scan did
+ * not, the segment map is not saved, and the next run starts from scratch.
+ */
+
+#define SEGMENT_HEADER "outline2c segments 1"
+
+/**
+ * A top-level node's place in the input and output.
+ */
+typedef struct {
+  uint64_t key;             /* Hash of the input text and surroundings */
+  uint64_t in_start;
+  uint64_t in_end;
+  uint64_t out_start;
+  uint64_t out_end;
+} Segment;
+
+/**
+ * Collects segments while the parser runs.
+ */
+typedef struct {
+  OutRoutine or;            /* Where the nodes really go */
+  Source *in;
+  Scope *scope;
+  Symbol *seen;             /* The newest definition so far */
+  char const *last;         /* Where the previous node's input ended */
+  uint64_t env;             /* Hash of the input's definitions */
+  Segment *segments;
+  int count;
+  int cap;
+  uint64_t sources;         /* Hash of the files the surroundings cover */
+} SegmentParse;
+
+/**
+ * Hashes the files loaded so far during the current run, apart from the
+ * input itself.
+ */
+static uint64_t segment_sources(Source *in)
+{
+  Context *context = context_get();
+  uint64_t hash;
+
+  mutex_lock(&context->source_lock);
+  hash = cache_hash_sources(CACHE_HASH_INIT, context->source_list, in, context->source_run);
+  mutex_unlock(&context->source_lock);
+  return hash;
+}
+
+static void segment_defines(SegmentParse *self, char const *end)
+{
+  if (self->scope->first == self->seen) return;
+  self->seen = self->scope->first;
+  self->env = cache_hash(self->env, self->last, end);
+}
+
+static int segment_out_fn(void *data, Dynamic value)
+{
+  SegmentParse *self = data;
+  Segment *s;
+
+  if (self->count == self->cap) {
+    self->cap = self->cap ? 2*self->cap : 64;
+    self->segments = (Segment*)realloc(self->segments, self->cap*sizeof(Segment));
+    CHECK_MEMORY(self->segments);
+  }
+  s = &self->segments[self->count++];
+  s->in_start = self->last - self->in->data.p;
+  s->in_end = self->in->cursor - self->in->data.p;
+  segment_defines(self, self->in->cursor);
+  self->last = self->in->cursor;
+
+  return self->or.code(self->or.data, value);
+}
+
+/**
+ * Parses the input, noting which part of it each top-level node comes from.
+ */
+int segment_parse(Pool *pool, SegmentParse *self, Source *in, Scope *scope, OutRoutine or)
+{
+  Context *context = context_get();
+  OutRoutine wrapper;
+  char const build[] = CACHE_BUILD;
+  int i;
+
+  self->or = or;
+  self->in = in;
+  self->scope = scope;
+  self->seen = scope->first;
+  self->last = in->data.p;
+  self->env = cache_hash(CACHE_HASH_INIT, build, build + sizeof(build));
+  self->segments = 0;
+  self->count = self->cap = 0;
+
+  wrapper.code = segment_out_fn;
+  wrapper.data = self;
+  CHECK(parse_code(pool, in, scope, wrapper));
+  segment_defines(self, in->data.end);
+
+  /* Included files, including ones only generating would load: */
+  CHECK(depend_scan(pool, in));
+  self->sources = segment_sources(in);
+  mutex_lock(&context->source_lock);
+  self->env = cache_hash_sources(self->env, context->source_list, in, context->source_run);
+  mutex_unlock(&context->source_lock);
+
+  for (i = 0; i < self->count; ++i) {
+    Segment *s = &self->segments[i];
+    s->key = cache_hash(self->env, in->data.p + s->in_start, in->data.p + s->in_end);
+  }
+  return 1;
+}
+
+void segment_free(SegmentParse *self)
+{
+  free(self->segments);
+}
+
+static int segment_compare(void const *a, void const *b)
+{
+  uint64_t ka = ((Segment const*)a)->key;
+  uint64_t kb = ((Segment const*)b)->key;
+  return ka < kb ? -1 : kb < ka;
+}
+
+/**
+ * Loads the segment map from the previous run, along with the output it
+ * describes. Returns 0 if either is missing, or if the output has changed
+ * since the map was written.
+ */
+static int segment_load(Pool *pool, String filename, Segment **old, int *count, String *text)
+{
+  String map;
+  char const *p;
+  uint64_t size;
+  uint64_t hash;
+  int n, i;
+
+  if (!file_read(pool, string_cat(pool, filename, string_from_k(".olseg")).p, &map))
+    return 0;
+  if (sscanf(map.p, SEGMENT_HEADER " %" SCNu64 " %" SCNx64 " %d%n", &size, &hash, count, &n) != 3 ||
+    *count < 0 || string_size(map) < (size_t)*count)
+    return 0;
+  if (!file_read(pool, string_copy(pool, filename).p, text) ||
+    (uint64_t)string_size(*text) != size ||
+    cache_hash(CACHE_HASH_INIT, text->p, text->end) != hash)
+    return 0;
+
+  *old = (Segment*)pool_alloc(pool, (*count + 1)*sizeof(Segment), alignof(Segment));
+  p = map.p + n;
+  for (i = 0; i < *count; ++i) {
+    Segment *s = &(*old)[i];
+    if (sscanf(p, " %" SCNx64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 "%n", &s->key,
+      &s->in_start, &s->in_end, &s->out_start, &s->out_end, &n) != 5 ||
+      s->out_end < s->out_start || size < s->out_end)
+      return 0;
+    p += n;
+  }
+  qsort(*old, *count, sizeof(Segment), segment_compare);
+  return 1;
+}
+
+/**
+ * Writes the segment map for the new output.
+ */
+static int segment_save(Pool *pool, SegmentParse *self, String filename, Buffer *out)
+{
+  Buffer map = buffer_init(0x1000);
+  char line[128];
+  int i, rv;
+
+  sprintf(line, SEGMENT_HEADER " %" PRIu64 " %016" PRIx64 " %d\n",
+    (uint64_t)buffer_size(out), cache_hash(CACHE_HASH_INIT, out->p, out->end),
+    self->count);
+  buffer_write(&map, line, line + strlen(line));
+  for (i = 0; i < self->count; ++i) {
+    Segment *s = &self->segments[i];
+    sprintf(line, "%016" PRIx64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", s->key,
+      s->in_start, s->in_end, s->out_start, s->out_end);
+    buffer_write(&map, line, line + strlen(line));
+  }
+
+  filename = string_cat(pool, filename, string_from_k(".olseg"));
+  rv = file_equal(filename.p, map.p, map.end) ||
+    file_write(pool, filename, map.p, map.end);
+  buffer_free(&map);
+  return rv;
+}
+
+/**
+ * Generates the output, copying any unchanged segments from the previous
+ * run's output, then saves the new segment map.
+ */
+int segment_generate(Pool *pool, SegmentParse *self, ListNode *code, String filename)
+{
+  Buffer out = buffer_init(0x10000);
+  Segment *old = 0;
+  String text;
+  int old_count = 0, i, rv = 1;
+
+  filename = string_copy(pool, filename);
+  if (!segment_load(pool, filename, &old, &old_count, &text))
+    old_count = 0;
+
+  for (i = 0; rv && code; code = code->next, ++i) {
+    Segment *s = &self->segments[i];
+    Segment *match = old_count ?
+      bsearch(s, old, old_count, sizeof(Segment), segment_compare) : 0;
+
+    s->out_start = buffer_size(&out);
+    if (match)
+      rv = buffer_write(&out, text.p + match->out_start, text.p + match->out_end);
+    else if (code->d.type != type_output) /* The caller writes these */
+      rv = generate(pool, &out, code->d);
+    s->out_end = buffer_size(&out);
+  }
+
+  if (rv && !file_equal(filename.p, out.p, out.end))
+    rv = file_write(pool, filename, out.p, out.end);
+  if (rv && segment_sources(self->in) != self->sources)
+    remove(string_cat(pool, filename, string_from_k(".olseg")).p);
+  else if (rv)
+    rv = segment_save(pool, self, filename, &out);
+  buffer_free(&out);
+  return rv;
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * A compile server. Starting a fresh process for every file throws away the
+ * include cache, so `outline2c --server <socket>` keeps running and does the
+ * compiling for clients instead. A client is outline2c itself, given the
+ * --connect option or the OUTLINE2C_SERVER environment variable. It sends
+ * its command line, working directory, umask and standard file handles over
+ * a Unix domain socket, then exits with whatever status the server reports.
+ * If no server is answering, the client just does the work itself.
+ *
+ * The server handles one request at a time, since each request takes over
+ * the process's working directory and standard file handles. A client that
+ * stops sending partway through a request gets dropped after a few seconds,
+ * so it cannot hold up everyone else's builds.
+ *
+ * The server reads and writes files as whoever started it, so only that
+ * same user may connect. The socket is created readable and writable by
+ * its owner alone, and the server also checks each client's user ID.
+ */
+
+#define SERVER_MAGIC 0x6f6c3263
+
+/* The largest command line a client may send. Anything bigger is dropped: */
+#define SERVER_MAX_REQUEST 0x400000
+
+/* How long a client may take to send its request, in seconds: */
+#define SERVER_TIMEOUT 5
+
+int main_run(Scope *keywords, int argc, char *argv[]);
+
+/**
+ * The first thing a client sends, along with its standard file handles.
+ * The command line follows, as a block of null-terminated strings with the
+ * working directory first.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t umask;
+  uint32_t size;          /* The size of the block that follows */
+} ServerRequest;
+
+#if defined(WIN32)
+int server_run(Pool *pool, String path, Scope *keywords)
+{
+  fprintf(stderr, "error: The compile server is not supported on this platform.\n");
+  return 0;
+}
+
+int client_run(Pool *pool, String path, int argc, char *argv[], int *status)
+{
+  return 0;
+}
+#else
+
+/**
+ * Fills in a socket address. Returns 0 if the path is too long.
+ */
+static int server_address(struct sockaddr_un *addr, String path)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (sizeof(addr->sun_path) <= (size_t)string_size(path)) {
+    fprintf(stderr, "error: The socket name \"%s\" is too long.\n", path.p);
+    return 0;
+  }
+  memcpy(addr->sun_path, path.p, string_size(path));
+  return 1;
+}
+
+static int server_write(int fd, void const *p, size_t size)
+{
+  char const *data = (char const*)p;
+  while (size) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    data += n;
+    size -= n;
+  }
+  return 1;
+}
+
+static int server_read(int fd, void *p, size_t size)
+{
+  char *data = (char*)p;
+  while (size) {
+    ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    data += n;
+    size -= n;
+  }
+  return 1;
+}
+
+/**
+ * Closes any file handles that came along with a message.
+ */
+static void server_close_fds(struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int *fd = (int*)CMSG_DATA(cmsg);
+      int *end = (int*)((char*)cmsg + cmsg->cmsg_len);
+      for (; fd < end; ++fd)
+        close(*fd);
+    }
+  }
+}
+
+/**
+ * Receives a request header, along with the client's standard file handles.
+ * If the request is no good, any handles that came with it get closed.
+ */
+static int server_read_request(int sock, ServerRequest *request, int fds[3])
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(3*sizeof(int))];
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = request;
+  iov.iov_len = sizeof(*request);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  do {
+    n = recvmsg(sock, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) return 0;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(*request) || request->magic != SERVER_MAGIC ||
+    (msg.msg_flags & MSG_CTRUNC) ||
+    !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+    cmsg->cmsg_len != CMSG_LEN(3*sizeof(int)) || CMSG_NXTHDR(&msg, cmsg)) {
+    server_close_fds(&msg);
+    return 0;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 3*sizeof(int));
+  return 1;
+}
+
+/**
+ * Determines whether a client belongs to the same user as the server.
+ */
+static int server_peer_ok(int sock)
+{
+#if defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t size = sizeof(cred);
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size)) return 0;
+  return cred.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(sock, &uid, &gid)) return 0;
+  return uid == geteuid();
+#endif
+}
+
+/**
+ * Runs one client's request, with the client's working directory, umask
+ * and standard file handles standing in for the server's own.
+ */
+static int server_handle(int sock, int home, int saved[3], Scope *keywords)
+{
+  Pool pool = pool_init(0x1000);
+  ServerRequest request;
+  int fds[3], i, argc;
+  char *data, *p, **argv;
+  mode_t mask;
+  int32_t status = 1;
+
+  if (!server_read_request(sock, &request, fds)) {
+    pool_free(&pool);
+    return 0;
+  }
+  if (request.size > SERVER_MAX_REQUEST) {
+    for (i = 0; i < 3; ++i)
+      close(fds[i]);
+    pool_free(&pool);
+    return 0;
+  }
+  data = (char*)pool_alloc(&pool, request.size + 1, 1);
+  if (!server_read(sock, data, request.size)) goto done;
+  data[request.size] = 0;
+
+  /* Split up the block, skipping the working directory: */
+  argc = 0;
+  for (p = data; p < data + request.size; p += strlen(p) + 1)
+    ++argc;
+  if (argc < 2) goto done;
+  argv = (char**)pool_alloc(&pool, argc*sizeof(char*), alignof(char*));
+  for (p = data + strlen(data) + 1, i = 0; p < data + request.size; p += strlen(p) + 1)
+    argv[i++] = p;
+  argv[i] = 0;
+  --argc;
+
+  /* Take on the client's identity: */
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i < 3; ++i)
+    dup2(fds[i], i);
+  mask = umask((mode_t)request.umask);
+  if (chdir(data))
+    fprintf(stderr, "error: Could not change to directory \"%s\"\n", data);
+  else
+    status = main_run(keywords, argc, argv);
+
+  /* Go back to being the server: */
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i < 3; ++i)
+    dup2(saved[i], i);
+  umask(mask);
+  if (fchdir(home))
+    fprintf(stderr, "error: Could not return to the server's directory\n");
+
+done:
+  for (i = 0; i < 3; ++i)
+    close(fds[i]);
+  server_write(sock, &status, sizeof(status));
+  pool_free(&pool);
+  return 1;
+}
+
+/**
+ * Listens for clients on a Unix domain socket, forever.
+ */
+int server_run(Pool *pool, String path, Scope *keywords)
+{
+  struct sockaddr_un addr;
+  struct timeval timeout;
+  mode_t mask;
+  int sock, home, saved[3], i, rv;
+
+  if (!server_address(&addr, path)) return 0;
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Clear out a socket left behind by a server that has gone away: */
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) return 0;
+  if (!connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "error: A server is already running on \"%s\".\n", path.p);
+    close(sock);
+    return 0;
+  }
+  unlink(path.p);
+
+  /* Only the server's own user gets to use the socket: */
+  mask = umask(077);
+  rv = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+  umask(mask);
+  if (rv || listen(sock, 64)) {
+    fprintf(stderr, "error: Could not listen on \"%s\".\n", path.p);
+    close(sock);
+    return 0;
+  }
+
+  home = open(".", O_RDONLY);
+  for (i = 0; i < 3; ++i)
+    saved[i] = dup(i);
+  timeout.tv_sec = SERVER_TIMEOUT;
+  timeout.tv_usec = 0;
+
+  while (1) {
+    int client = accept(sock, 0, 0);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+    if (server_peer_ok(client) &&
+      !setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)))
+      server_handle(client, home, saved, keywords);
+    close(client);
+  }
+
+  fprintf(stderr, "error: The server stopped accepting connections.\n");
+  close(sock);
+  return 0;
+}
+
+/**
+ * Adds a null-terminated string to a request.
+ */
+static int client_add(Buffer *body, char const *s)
+{
+  return buffer_write(body, s, s + strlen(s) + 1);
+}
+
+/**
+ * Sends a command line to a server and waits for the result. Returns 0 if
+ * no server is answering, so the caller can do the work itself.
+ */
+int client_run(Pool *pool, String path, int argc, char *argv[], int *status)
+{
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(3*sizeof(int))];
+  ServerRequest request;
+  Buffer body;
+  char const *env;
+  int sock, fds[3] = {0, 1, 2}, i;
+  mode_t mask;
+  int32_t result;
+
+  if (!server_address(&addr, path)) return 0;
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) return 0;
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    close(sock);
+    return 0;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Working directory: */
+  body = buffer_init(0x1000);
+  while (!getcwd(body.p, body.cap - body.p)) {
+    if (errno != ERANGE) goto error;
+    buffer_reserve(&body, 2*(body.cap - body.p));
+  }
+  body.end = body.p + strlen(body.p) + 1;
+
+  /* The command line, with the server's own options replaced by the
+   * settings which would otherwise come from the environment: */
+  client_add(&body, argv[0]);
+  env = getenv("OUTLINE2C_CACHE_DIR");
+  if (env && *env) {
+    client_add(&body, "--cache-dir");
+    client_add(&body, env);
+  }
+  env = getenv("OUTLINE2C_CACHE_SIZE");
+  if (env && *env) {
+    client_add(&body, "--cache-size");
+    client_add(&body, env);
+  }
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+      ++i;
+      continue;
+    }
+    client_add(&body, argv[i]);
+  }
+
+  mask = umask(0);
+  umask(mask);
+  request.magic = SERVER_MAGIC;
+  request.umask = (uint32_t)mask;
+  request.size = (uint32_t)buffer_size(&body);
+
+  /* The header carries the file handles: */
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = &request;
+  iov.iov_len = sizeof(request);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(3*sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, 3*sizeof(int));
+  if (sendmsg(sock, &msg, 0) != sizeof(request)) goto error;
+  if (!server_write(sock, body.p, buffer_size(&body))) goto error;
+  buffer_free(&body);
+
+  /* Once the server has the request, it is responsible for the result: */
+  if (!server_read(sock, &result, sizeof(result))) {
+    fprintf(stderr, "error: The server at \"%s\" did not finish the request.\n", path.p);
+    result = 1;
+  }
+  close(sock);
+  *status = result;
+  return 1;
+
+error:
+  buffer_free(&body);
+  close(sock);
+  return 0;
+}
+#endif
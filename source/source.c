@@ -17,76 +17,208 @@
 /**
  * A source file
  */
-typedef struct Source {
+struct Source {
   String filename;
   String data;
   char const *cursor;
-  struct Source *next;
-} Source;
+  Source *parent;         /* The file which included this one, if any */
+  int run;                /* The last compiler run to use this file */
+  int keep;               /* Outlives the run, as part of the include cache */
+  Source *next;
+};
+
+/*
+ * Each context keeps a linked list of Source structures. This makes it
+ * possible to find line and column information in any file using only a
+ * character pointer.
+ *
+ * The context also numbers its compiler runs. A server handles many runs,
+ * and the files a run depends on are the ones stamped with its number.
+ */
 
 /**
- * A global linked list of Source structures. This makes it possible to find
- * line and column information in any file using only a character pointer.
+ * Registers a block of text which is already in memory as a source file. The
+ * text must stay in place for as long as the source is in use.
  */
-Source *source_list = 0;
+Source *source_add(Pool *pool, String filename, String data)
+{
+  Context *context = context_get();
+  Source *self = pool_new(pool, Source);
+  self->filename = filename;
+  self->data = data;
+  self->cursor = self->data.p;
+  self->parent = 0;
+  self->keep = 0;
+  mutex_lock(&context->source_lock);
+  self->run = context->source_run;
+  self->next = context->source_list;
+  context->source_list = self;
+  mutex_unlock(&context->source_lock);
+  return self;
+}
 
 /**
- * Loads a file into a Source structure
+ * Takes a source file back off the list, for a loader that gives up on it.
+ */
+void source_remove(Source *self)
+{
+  Context *context = context_get();
+  Source **p;
+
+  mutex_lock(&context->source_lock);
+  for (p = &context->source_list; *p; p = &(*p)->next) {
+    if (*p == self) {
+      *p = self->next;
+      break;
+    }
+  }
+  mutex_unlock(&context->source_lock);
+}
+
+/**
+ * Loads a file into a Source structure. If the context has a resolver, that
+ * supplies the file instead of the disk. The name "-" means standard input.
  */
 Source *source_load(Pool *pool, String filename)
 {
-  FILE *fp = 0;
-  long size;
+  Context *context = context_get();
+  String text;
   char *data;
-  Source *self;
 
   filename = string_copy(pool, filename);
 
-  fp = fopen(filename.p, "rb");
-  if (!fp) return 0;
+  if (context->resolve) {
+    char const *text;
+    size_t length;
+    if (!context->resolve(context->resolve_data, filename.p, &text, &length))
+      return 0;
+    data = (char*)pool_alloc(pool, length + 1, 1);
+    memcpy(data, text, length);
+    data[length] = 0;
+    return source_add(pool, filename, string(data, data + length));
+  }
 
-  if (fseek(fp, 0, SEEK_END))
-    goto error;
+  if (string_equal(filename, string_from_k("-"))) {
+#if defined(WIN32)
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    if (!file_read_stream(pool, stdin, &text)) return 0;
+    return source_add(pool, string_from_k("<stdin>"), text);
+  }
 
-  size = ftell(fp);
-  if (size == -1L) goto error;
+  if (!file_read(pool, filename.p, &text)) return 0;
+  return source_add(pool, filename, text);
+}
 
-  if (fseek(fp, 0, SEEK_SET))
-    goto error;
+/**
+ * Finishes a compiler run, dropping every source file which the include
+ * cache is not holding on to. Their memory belongs to the run's pool, which
+ * the caller frees next.
+ */
+void source_end_run(void)
+{
+  Context *context = context_get();
+  Source **p;
+
+  mutex_lock(&context->source_lock);
+  for (p = &context->source_list; *p; ) {
+    if ((*p)->keep) {
+      if ((*p)->parent && !(*p)->parent->keep)
+        (*p)->parent = 0;
+      p = &(*p)->next;
+    } else {
+      *p = (*p)->next;
+    }
+  }
+  ++context->source_run;
+  mutex_unlock(&context->source_lock);
+}
 
-  data = (char*)pool_alloc(pool, size + 1, 1);
+/**
+ * Resolves a file name relative to the directory holding another file.
+ */
+String source_path(Pool *pool, String filename, String name)
+{
+  char const *p, *base_end;
 
-  if (fread(data, 1, size, fp) != size)
-    goto error;
-  data[size] = 0;
+  base_end = filename.p;
+  for (p = filename.p; p < filename.end; ++p)
+    if (*p == '\\' || *p == '/')
+      base_end = p + 1;
+  return string_cat(pool, string(filename.p, base_end), name);
+}
 
-  self = pool_new(pool, Source);
-  self->filename = filename;
-  self->data = string(data, data + size);
-  self->cursor = self->data.p;
-  self->next = source_list;
-  source_list = self;
+/**
+ * Tidies up a path for comparing with other paths. This drops "." segments
+ * and repeated slashes, and lets ".." cancel the directory before it. Only
+ * the text is examined, so two paths to one file through a symbolic link
+ * still differ. The result uses forward slashes throughout.
+ */
+String source_clean_path(Pool *pool, String path)
+{
+  char *out = (char*)pool_alloc(pool, string_size(path) + 2, 1);
+  char *end = out, *root, *last;
+  char const *p = path.p, *segment;
+  size_t size;
+
+  if (p < path.end && (*p == '/' || *p == '\\'))
+    *end++ = '/';
+  root = end;
+
+  while (p < path.end) {
+    segment = p;
+    while (p < path.end && *p != '/' && *p != '\\') ++p;
+    size = p - segment;
+    if (p < path.end) ++p;
+    if (!size || (size == 1 && *segment == '.'))
+      continue;
+
+    if (size == 2 && segment[0] == '.' && segment[1] == '.') {
+      for (last = end; root < last && last[-1] != '/'; --last) ;
+      if (last != end && !(end - last == 2 && last[0] == '.' && last[1] == '.')) {
+        /* Cancel the previous directory: */
+        end = root < last ? last - 1 : root;
+        continue;
+      }
+      if (root != out) continue; /* Nothing is above the root */
+    }
 
-  fclose(fp);
-  return self;
+    if (end != root) *end++ = '/';
+    memcpy(end, segment, size);
+    end += size;
+  }
 
-error:
-  fclose(fp);
-  return 0;
+  if (end == out) *end++ = '.';
+  *end = 0;
+  return string(out, end);
 }
 
 /**
- * Formats and prints a source location
+ * Finds the loaded file containing a particular character pointer.
  */
-int source_location(FILE *stream, char const *location)
+Source *source_find(char const *location)
 {
-  unsigned line;
-  unsigned column;
-  char const *p;
+  Context *context = context_get();
+  Source *self;
 
-  Source *self = source_list;
+  mutex_lock(&context->source_lock);
+  self = context->source_list;
   while (self && (location < self->data.p || self->data.end < location))
     self = self->next;
+  mutex_unlock(&context->source_lock);
+  return self;
+}
+
+/**
+ * Formats and reports a source location, as the start of an error message.
+ */
+int source_location(char const *location)
+{
+  uint64_t line;
+  uint64_t column;
+  char const *p;
+
+  Source *self = source_find(location);
   if (!self)
     return 0;
 
@@ -104,15 +236,16 @@ int source_location(FILE *stream, char const *location)
     }
   }
 
-  return 0 < fprintf(stream, "%s:%d:%d: ", self->filename.p, line + 1, column + 1);
+  context_error("%s:%" PRIu64 ":%" PRIu64 ": ", self->filename.p, line + 1, column + 1);
+  return 1;
 }
 
 /**
- * Prints an error message related to a source file
+ * Reports an error message related to a source file
  */
 int source_error(char const *location, char const *message)
 {
-  source_location(stderr, location);
-  fprintf(stderr, "%s\n", message);
+  source_location(location);
+  context_error("%s\n", message);
   return 0;
 }
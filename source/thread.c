@@ -0,0 +1,234 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * A thin layer over the platform's threading primitives. Only the handful of
+ * operations the compiler actually needs are provided: starting and joining
+ * threads, mutexes and condition variables for coordinating them, and
+ * per-thread values for finding the current compiler context.
+ */
+
+typedef void (*ThreadFn)(void *data);
+
+/**
+ * The platform thread routines have their own signatures, so new threads
+ * start in a small trampoline which then calls the real function.
+ */
+typedef struct {
+  ThreadFn code;
+  void *data;
+} ThreadStart;
+
+#if defined(WIN32)
+typedef HANDLE Thread;
+typedef DWORD ThreadId;
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Cond;
+typedef INIT_ONCE Once;
+typedef DWORD ThreadKey;
+
+#define MUTEX_INIT SRWLOCK_INIT
+#define COND_INIT CONDITION_VARIABLE_INIT
+#define ONCE_INIT INIT_ONCE_STATIC_INIT
+
+static DWORD WINAPI thread_trampoline(LPVOID p)
+{
+  ThreadStart start = *(ThreadStart*)p;
+  free(p);
+  start.code(start.data);
+  return 0;
+}
+
+int thread_start(Thread *thread, ThreadFn code, void *data)
+{
+  ThreadStart *start = (ThreadStart*)malloc(sizeof(ThreadStart));
+  CHECK_MEMORY(start);
+  start->code = code;
+  start->data = data;
+  *thread = CreateThread(0, 0, thread_trampoline, start, 0, 0);
+  if (!*thread) {
+    free(start);
+    return 0;
+  }
+  return 1;
+}
+
+void thread_join(Thread thread)
+{
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+ThreadId thread_self(void) { return GetCurrentThreadId(); }
+int thread_equal(ThreadId a, ThreadId b) { return a == b; }
+
+/**
+ * Returns the number of processors available to run threads.
+ */
+int thread_count(void)
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+}
+
+void mutex_init(Mutex *m) { InitializeSRWLock(m); }
+void mutex_free(Mutex *m) { }
+void mutex_lock(Mutex *m) { AcquireSRWLockExclusive(m); }
+void mutex_unlock(Mutex *m) { ReleaseSRWLockExclusive(m); }
+
+void cond_init(Cond *c) { InitializeConditionVariable(c); }
+void cond_free(Cond *c) { }
+void cond_wait(Cond *c, Mutex *m) { SleepConditionVariableSRW(c, m, INFINITE, 0); }
+void cond_signal(Cond *c) { WakeConditionVariable(c); }
+void cond_broadcast(Cond *c) { WakeAllConditionVariable(c); }
+
+static BOOL CALLBACK once_trampoline(PINIT_ONCE once, PVOID code, PVOID *data)
+{
+  ((void (*)(void))code)();
+  return TRUE;
+}
+
+void thread_once(Once *once, void (*code)(void))
+{
+  InitOnceExecuteOnce(once, once_trampoline, (PVOID)code, 0);
+}
+
+int thread_key_init(ThreadKey *key)
+{
+  *key = TlsAlloc();
+  return *key != TLS_OUT_OF_INDEXES;
+}
+
+void *thread_key_get(ThreadKey key) { return TlsGetValue(key); }
+void thread_key_set(ThreadKey key, void *value) { TlsSetValue(key, value); }
+#else
+typedef pthread_t Thread;
+typedef pthread_t ThreadId;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+typedef pthread_once_t Once;
+typedef pthread_key_t ThreadKey;
+
+#define MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define COND_INIT PTHREAD_COND_INITIALIZER
+#define ONCE_INIT PTHREAD_ONCE_INIT
+
+static void *thread_trampoline(void *p)
+{
+  ThreadStart start = *(ThreadStart*)p;
+  free(p);
+  start.code(start.data);
+  return 0;
+}
+
+int thread_start(Thread *thread, ThreadFn code, void *data)
+{
+  ThreadStart *start = (ThreadStart*)malloc(sizeof(ThreadStart));
+  CHECK_MEMORY(start);
+  start->code = code;
+  start->data = data;
+  if (pthread_create(thread, 0, thread_trampoline, start)) {
+    free(start);
+    return 0;
+  }
+  return 1;
+}
+
+void thread_join(Thread thread)
+{
+  pthread_join(thread, 0);
+}
+
+ThreadId thread_self(void) { return pthread_self(); }
+int thread_equal(ThreadId a, ThreadId b) { return pthread_equal(a, b); }
+
+/**
+ * Returns the number of processors available to run threads.
+ */
+int thread_count(void)
+{
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count < 1 ? 1 : (int)count;
+}
+
+void mutex_init(Mutex *m) { pthread_mutex_init(m, 0); }
+void mutex_free(Mutex *m) { pthread_mutex_destroy(m); }
+void mutex_lock(Mutex *m) { pthread_mutex_lock(m); }
+void mutex_unlock(Mutex *m) { pthread_mutex_unlock(m); }
+
+void cond_init(Cond *c) { pthread_cond_init(c, 0); }
+void cond_free(Cond *c) { pthread_cond_destroy(c); }
+void cond_wait(Cond *c, Mutex *m) { pthread_cond_wait(c, m); }
+void cond_signal(Cond *c) { pthread_cond_signal(c); }
+void cond_broadcast(Cond *c) { pthread_cond_broadcast(c); }
+
+/**
+ * Runs a function exactly once, no matter how many threads get here.
+ */
+void thread_once(Once *once, void (*code)(void)) { pthread_once(once, code); }
+
+int thread_key_init(ThreadKey *key) { return !pthread_key_create(key, 0); }
+void *thread_key_get(ThreadKey key) { return pthread_getspecific(key); }
+void thread_key_set(ThreadKey key, void *value) { pthread_setspecific(key, value); }
+#endif
+
+/**
+ * A mutex which its owner may lock again without blocking. Each lock needs a
+ * matching unlock.
+ */
+typedef struct {
+  Mutex lock;
+  Cond released;
+  int depth;
+  ThreadId owner;
+} RecursiveMutex;
+
+#define RECURSIVE_MUTEX_INIT {MUTEX_INIT, COND_INIT, 0}
+
+void rmutex_init(RecursiveMutex *m)
+{
+  mutex_init(&m->lock);
+  cond_init(&m->released);
+  m->depth = 0;
+}
+
+void rmutex_free(RecursiveMutex *m)
+{
+  cond_free(&m->released);
+  mutex_free(&m->lock);
+}
+
+void rmutex_lock(RecursiveMutex *m)
+{
+  ThreadId self = thread_self();
+
+  mutex_lock(&m->lock);
+  if (!m->depth || !thread_equal(m->owner, self)) {
+    while (m->depth)
+      cond_wait(&m->released, &m->lock);
+    m->owner = self;
+  }
+  ++m->depth;
+  mutex_unlock(&m->lock);
+}
+
+void rmutex_unlock(RecursiveMutex *m)
+{
+  mutex_lock(&m->lock);
+  if (!--m->depth)
+    cond_signal(&m->released);
+  mutex_unlock(&m->lock);
+}
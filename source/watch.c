@@ -0,0 +1,264 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Watch mode. `outline2c --watch a.ol b.ol ...` compiles each input, then
+ * waits for any file they depend on to change and compiles just the inputs
+ * that depend on it. The include cache stays warm the whole time, and only
+ * gives up an included file's definitions when that file changes, so a
+ * regeneration only parses the files that were touched plus the input itself.
+ *
+ * Editors often save by writing a new file and renaming it over the old one,
+ * which would leave a watch on the old file behind. Watching the directories
+ * instead catches every way a file can change.
+ */
+
+int main_compile(Pool *pool, Scope *keywords, Options *opt);
+
+/**
+ * An input file, along with the files its output depends on.
+ */
+typedef struct {
+  String name;
+  Pool pool;              /* Holds the dependency list */
+  String *files;
+  int file_count;
+} WatchInput;
+
+#if defined(__linux__)
+
+/**
+ * One way of spelling a watched directory's name.
+ */
+typedef struct WatchName WatchName;
+struct WatchName {
+  String name;            /* Including the trailing slash, or empty */
+  WatchName *next;
+};
+
+/**
+ * A watched directory. inotify hands back the same watch for every path
+ * that leads to one directory, so a directory may go by several names.
+ */
+typedef struct WatchDir WatchDir;
+struct WatchDir {
+  WatchName *names;
+  int wd;
+  WatchDir *next;
+};
+
+static double watch_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+/**
+ * Compiles one input, recording the files it read along the way.
+ */
+static void watch_compile(Scope *keywords, Options *opt, WatchInput *input)
+{
+  Context *context = context_get();
+  Pool pool = pool_init(0x10000);
+  Options o = *opt;
+  Source *source;
+  double start = watch_now();
+  int rv, i;
+
+  o.name_in = input->name;
+  rv = main_compile(&pool, keywords, &o);
+
+  /* Dependencies, which are still there even if the compile failed: */
+  pool_free(&input->pool);
+  input->pool = pool_init(0x1000);
+  mutex_lock(&context->source_lock);
+  input->file_count = 0;
+  for (source = context->source_list; source; source = source->next)
+    if (source->run == context->source_run) ++input->file_count;
+  input->files = (String*)pool_alloc(&input->pool, (input->file_count + 1)*sizeof(String), alignof(String));
+  input->files[0] = string_copy(&input->pool, input->name);
+  for (source = context->source_list, i = 1; source; source = source->next)
+    if (source->run == context->source_run)
+      input->files[i++] = string_copy(&input->pool, source->filename);
+  input->file_count = i;
+  mutex_unlock(&context->source_lock);
+
+  source_end_run();
+  pool_free(&pool);
+
+  printf("%s: %s in %.1f ms\n", input->name.p,
+    rv ? "regenerated" : "failed", 1000*(watch_now() - start));
+  fflush(stdout);
+}
+
+/**
+ * Starts watching the directory holding a file, unless it is already
+ * being watched. Another name for a watched directory gets added to it.
+ */
+static void watch_dir(Pool *pool, int fd, WatchDir **dirs, String filename)
+{
+  WatchDir *dir;
+  WatchName *n;
+  String name = source_path(pool, filename, string_from_k(""));
+  int wd;
+
+  for (dir = *dirs; dir; dir = dir->next)
+    for (n = dir->names; n; n = n->next)
+      if (string_equal(n->name, name)) return;
+
+  wd = inotify_add_watch(fd, string_size(name) ? name.p : ".",
+    IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB);
+  if (wd < 0) {
+    fprintf(stderr, "warning: Could not watch directory \"%s\"\n",
+      string_size(name) ? name.p : ".");
+    return;
+  }
+
+  for (dir = *dirs; dir; dir = dir->next)
+    if (dir->wd == wd) break;
+  if (!dir) {
+    dir = pool_new(pool, WatchDir);
+    dir->names = 0;
+    dir->wd = wd;
+    dir->next = *dirs;
+    *dirs = dir;
+  }
+  n = pool_new(pool, WatchName);
+  n->name = name;
+  n->next = dir->names;
+  dir->names = n;
+}
+
+/**
+ * Determines whether an input depends on a file.
+ */
+static int watch_uses(WatchInput *input, String filename)
+{
+  int i;
+  for (i = 0; i < input->file_count; ++i)
+    if (string_equal(input->files[i], filename))
+      return 1;
+  return 0;
+}
+
+/**
+ * A file which changed.
+ */
+typedef struct WatchChange WatchChange;
+struct WatchChange {
+  String name;
+  WatchChange *next;
+};
+
+/**
+ * Turns a block of inotify events into a list of changed files.
+ */
+static void watch_events(Pool *pool, WatchDir *dirs, WatchChange **changes,
+  char const *p, char const *end)
+{
+  while (p < end) {
+    struct inotify_event const *e = (struct inotify_event const*)p;
+    WatchDir *dir;
+    WatchName *n;
+    p += sizeof(struct inotify_event) + e->len;
+    if (!e->len) continue;
+
+    for (dir = dirs; dir; dir = dir->next)
+      if (dir->wd == e->wd) break;
+    if (!dir) continue;
+
+    /* The inputs may know the file by any of the directory's names: */
+    for (n = dir->names; n; n = n->next) {
+      WatchChange *change = pool_new(pool, WatchChange);
+      change->name = string_cat(pool, n->name, string_from_c(e->name));
+      change->next = *changes;
+      *changes = change;
+    }
+  }
+}
+
+/**
+ * Builds everything, then rebuilds things as their files change. This only
+ * returns if something goes wrong.
+ */
+int watch_run(Pool *pool, Scope *keywords, Options *opt)
+{
+  WatchInput *inputs;
+  WatchDir *dirs = 0;
+  int fd, i, j;
+
+  fd = inotify_init();
+  if (fd < 0) {
+    fprintf(stderr, "error: Could not start watching files.\n");
+    return 0;
+  }
+
+  inputs = (WatchInput*)pool_alloc(pool, opt->input_count*sizeof(WatchInput), alignof(WatchInput));
+  for (i = 0; i < opt->input_count; ++i) {
+    inputs[i].name = string_copy(pool, opt->inputs[i]);
+    inputs[i].pool = pool_init(0x1000);
+    watch_compile(keywords, opt, &inputs[i]);
+    for (j = 0; j < inputs[i].file_count; ++j)
+      watch_dir(pool, fd, &dirs, inputs[i].files[j]);
+  }
+
+  while (1) {
+    Pool round = pool_init(0x1000);
+    WatchChange *changes = 0, *change;
+    char events[0x4000];
+    struct pollfd wait;
+    ssize_t size;
+
+    /* Wait for a change, then keep collecting changes until things settle
+     * down for a moment, since saving a file can take several steps: */
+    wait.fd = fd;
+    wait.events = POLLIN;
+    size = read(fd, events, sizeof(events));
+    while (0 < size) {
+      watch_events(&round, dirs, &changes, events, events + size);
+      if (poll(&wait, 1, 50) <= 0) break;
+      size = read(fd, events, sizeof(events));
+    }
+    if (size < 0 && errno != EINTR) {
+      pool_free(&round);
+      break;
+    }
+
+    /* Rebuild whatever uses the changed files: */
+    for (i = 0; i < opt->input_count; ++i) {
+      for (change = changes; change; change = change->next)
+        if (watch_uses(&inputs[i], change->name)) break;
+      if (!change) continue;
+
+      watch_compile(keywords, opt, &inputs[i]);
+      for (j = 0; j < inputs[i].file_count; ++j)
+        watch_dir(pool, fd, &dirs, inputs[i].files[j]);
+    }
+    pool_free(&round);
+  }
+
+  fprintf(stderr, "error: Could not read file changes.\n");
+  close(fd);
+  return 0;
+}
+
+#else
+int watch_run(Pool *pool, Scope *keywords, Options *opt)
+{
+  fprintf(stderr, "error: Watch mode is not supported on this platform.\n");
+  return 0;
+}
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2010 William R. Swanson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Writes generated text to a file on a dedicated thread, so the generator
+ * never waits for the disk or a slow pipe.
+ *
+ * The writer owns a small ring of large memory blocks. The generator fills
+ * one block at a time through an ordinary Buffer. When that block is full,
+ * the Buffer's flush routine queues it and moves on to the next free block.
+ * Meanwhile, the writer thread takes every queued block at once and hands
+ * them to the operating system in a single gathering write.
+ */
+
+#define WRITER_BLOCKS 4
+#define WRITER_BLOCK_SIZE 0x100000 /* 1M */
+
+typedef struct {
+  Buffer out;                   /* The generator writes here */
+  int fd;
+  char *blocks[WRITER_BLOCKS];
+  size_t used[WRITER_BLOCKS];
+  int head;                     /* The oldest queued block */
+  int count;                    /* The number of queued blocks */
+  int closing;
+  int failed;
+  int threaded;
+  Thread thread;
+  Mutex lock;
+  Cond changed;
+} Writer;
+
+/**
+ * Writes a run of consecutive blocks from the ring, starting at `first`.
+ * Returns 0 for failure.
+ */
+static int writer_write_blocks(Writer *self, int first, int n)
+{
+#if defined(WIN32)
+  int i;
+  for (i = 0; i < n; ++i) {
+    int b = (first + i) % WRITER_BLOCKS;
+    char const *p = self->blocks[b];
+    char const *end = p + self->used[b];
+    while (p < end) {
+      int done = _write(self->fd, p, (unsigned)(end - p));
+      if (done <= 0) return 0;
+      p += done;
+    }
+  }
+  return 1;
+#else
+  struct iovec iov[WRITER_BLOCKS];
+  struct iovec *v = iov;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    int b = (first + i) % WRITER_BLOCKS;
+    iov[i].iov_base = self->blocks[b];
+    iov[i].iov_len = self->used[b];
+  }
+
+  /* Keep going until the kernel has taken everything: */
+  while (n) {
+    ssize_t done = writev(self->fd, v, n);
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    while (n && v->iov_len <= (size_t)done) {
+      done -= v->iov_len;
+      ++v; --n;
+    }
+    if (n) {
+      v->iov_base = (char*)v->iov_base + done;
+      v->iov_len -= done;
+    }
+  }
+  return 1;
+#endif
+}
+
+static void writer_thread(void *data)
+{
+  Writer *self = data;
+
+  mutex_lock(&self->lock);
+  for (;;) {
+    int first, n, ok;
+    while (!self->count && !self->closing)
+      cond_wait(&self->changed, &self->lock);
+    if (!self->count) break;
+
+    /* Write everything that is ready, without holding the lock: */
+    first = self->head;
+    n = self->count;
+    mutex_unlock(&self->lock);
+    ok = self->failed || writer_write_blocks(self, first, n);
+    mutex_lock(&self->lock);
+
+    if (!ok) self->failed = 1;
+    self->head = (self->head + n) % WRITER_BLOCKS;
+    self->count -= n;
+    cond_broadcast(&self->changed);
+  }
+  mutex_unlock(&self->lock);
+}
+
+/**
+ * The flush routine for the generator's buffer. Queues the current block,
+ * then waits for a free one.
+ */
+static int writer_flush_fn(void *data, Buffer *b)
+{
+  Writer *self = data;
+  int next, failed;
+
+  if (!self->threaded) {
+    self->used[0] = buffer_size(b);
+    if (!self->failed && !writer_write_blocks(self, 0, 1))
+      self->failed = 1;
+    b->end = b->p;
+    return !self->failed;
+  }
+
+  mutex_lock(&self->lock);
+  next = (self->head + self->count) % WRITER_BLOCKS;
+  self->used[next] = buffer_size(b);
+  ++self->count;
+  cond_broadcast(&self->changed);
+  while (self->count == WRITER_BLOCKS)
+    cond_wait(&self->changed, &self->lock);
+  next = (self->head + self->count) % WRITER_BLOCKS;
+  failed = self->failed;
+  mutex_unlock(&self->lock);
+
+  b->p = b->end = self->blocks[next];
+  b->cap = b->p + WRITER_BLOCK_SIZE;
+  return !failed;
+}
+
+/**
+ * Prepares a writer for the given file descriptor, and starts its thread.
+ * If the thread will not start, the writer falls back on writing each block
+ * as soon as it fills.
+ */
+void writer_init(Writer *self, int fd)
+{
+  int i;
+
+  for (i = 0; i < WRITER_BLOCKS; ++i) {
+    self->blocks[i] = (char*)malloc(WRITER_BLOCK_SIZE);
+    CHECK_MEMORY(self->blocks[i]);
+    self->used[i] = 0;
+  }
+  self->fd = fd;
+  self->head = 0;
+  self->count = 0;
+  self->closing = 0;
+  self->failed = 0;
+
+  self->out.p = self->out.end = self->blocks[0];
+  self->out.cap = self->out.p + WRITER_BLOCK_SIZE;
+  self->out.flush = writer_flush_fn;
+  self->out.data = self;
+
+  mutex_init(&self->lock);
+  cond_init(&self->changed);
+  self->threaded = thread_start(&self->thread, writer_thread, self);
+}
+
+/**
+ * Writes out anything left in the buffer, stops the writer thread, and frees
+ * the memory blocks. Returns 0 if any write failed along the way.
+ */
+int writer_finish(Writer *self)
+{
+  int i, rv;
+
+  rv = buffer_flush(&self->out);
+  if (self->threaded) {
+    mutex_lock(&self->lock);
+    self->closing = 1;
+    cond_broadcast(&self->changed);
+    mutex_unlock(&self->lock);
+    thread_join(self->thread);
+  }
+  rv = rv && !self->failed;
+
+  for (i = 0; i < WRITER_BLOCKS; ++i)
+    free(self->blocks[i]);
+  cond_free(&self->changed);
+  mutex_free(&self->lock);
+  return rv;
+}